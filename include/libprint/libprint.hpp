@@ -1,67 +1,2693 @@
 #pragma once
 #include "peglib.h"
+#include "width_tables.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
-#include <codecvt>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <fmt/args.h>
 #include <fmt/color.h>
 #include <fmt/format.h>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <limits>
-#include <locale>
+#include <list>
 #include <map>
-#include <regex>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
 #include <sstream>
-#include <stack>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unistd.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace std::string_literals;
 using milliseconds_t = std::chrono::duration<double, std::milli>;
 using namespace peg;
 using namespace peg::udl;
 
-namespace LibPrint {
+namespace LibPrint {
+
+// Byte search primitives: AVX2 or SSE2 when the target has them, a scalar
+// loop otherwise.
+class Simd {
+public:
+  // First byte in [p, end) equal to one of `needles`, or `end`.
+  template <typename... Chars>
+  static const char *find(const char *p, const char *end, Chars... needles) {
+#if defined(__AVX2__)
+    for (; end - p >= 32; p += 32) {
+      auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+      auto hits = _mm256_setzero_si256();
+      ((hits = _mm256_or_si256(
+            hits, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(needles)))),
+       ...);
+      if (auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits)))
+        return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; end - p >= 16; p += 16) {
+      auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      auto hits = _mm_setzero_si128();
+      ((hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(needles)))),
+       ...);
+      if (auto mask = static_cast<uint32_t>(_mm_movemask_epi8(hits)))
+        return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++) {
+      if (((*p == needles) || ...))
+        return p;
+    }
+    return end;
+  }
+
+  // First byte in [p, end) outside printable ASCII, or `end`.
+  static const char *skipAscii(const char *p, const char *end) {
+#if defined(__AVX2__)
+    for (; end - p >= 32; p += 32) {
+      auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+      auto printable = _mm256_andnot_si256(
+          _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f)),
+          _mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(0x1f)));
+      if (auto mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(printable)))
+        return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; end - p >= 16; p += 16) {
+      auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      auto printable =
+          _mm_andnot_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(0x7f)),
+                           _mm_cmpgt_epi8(chunk, _mm_set1_epi8(0x1f)));
+      if (auto mask = ~static_cast<uint32_t>(_mm_movemask_epi8(printable)) &
+                      0xffff)
+        return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && *p >= 0x20 && *p < 0x7f)
+      p++;
+    return p;
+  }
+
+  static bool contains(std::string_view text, char c) {
+    auto end = text.data() + text.size();
+    return find(text.data(), end, c) != end;
+  }
+};
+
+// Lazy view over the fields of `text` separated by `delimiter`, as
+// std::string_view into the original text. Like std::getline, a trailing
+// delimiter does not produce an empty last field.
+class Split : public std::ranges::view_interface<Split> {
+public:
+  class iterator {
+  public:
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using iterator_concept = std::forward_iterator_tag;
+    using iterator_category = std::forward_iterator_tag;
+
+    iterator() = default;
+    iterator(std::string_view text, char delimiter)
+        : next(text.data()), end(text.data() + text.size()),
+          delimiter(delimiter), done(false) {
+      ++*this;
+    }
+
+    std::string_view operator*() const { return field; }
+
+    iterator &operator++() {
+      if (next == end) {
+        done = true;
+        return *this;
+      }
+      auto p = Simd::find(next, end, delimiter);
+      field = std::string_view(next, p - next);
+      next = p == end ? end : p + 1;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      auto it = *this;
+      ++*this;
+      return it;
+    }
+
+    bool operator==(const iterator &other) const {
+      return done == other.done && (done || next == other.next);
+    }
+
+    bool operator==(std::default_sentinel_t) const { return done; }
+
+  private:
+    const char *next = nullptr;
+    const char *end = nullptr;
+    std::string_view field;
+    char delimiter = 0;
+    bool done = true;
+  };
+
+  Split() = default;
+  Split(std::string_view text, char delimiter)
+      : text(text), delimiter(delimiter) {}
+
+  iterator begin() const { return iterator(text, delimiter); }
+  std::default_sentinel_t end() const { return std::default_sentinel; }
+
+private:
+  std::string_view text;
+  char delimiter = '\n';
+};
+
+// Fixed-size output buffer usable in constant expressions. StaticBuffer<0>
+// only counts bytes.
+template <std::size_t N> struct StaticBuffer {
+  char text[N + 1]{};
+  std::size_t length = 0;
+  constexpr void append(const char *begin, const char *end) {
+    for (; begin != end; begin++, length++) {
+      if constexpr (N > 0)
+        text[length] = *begin;
+    }
+  }
+  constexpr std::size_t size() const { return length; }
+  constexpr void resize(std::size_t n) { length = n; }
+};
+
+// How styles reach the output. NONE drops tags and escape sequences and
+// writes only the text, for files and pipes. ANSI16 and ANSI256 map colors
+// to the nearest entry of the terminal palette.
+enum class ColorMode { NONE, ANSI16, ANSI256, TRUECOLOR };
+
+enum class Align { LEFT, MIDDLE, RIGHT };
+
+// Terminal color as it appears in SGR sequences.
+struct Color {
+  enum Kind : uint8_t { DEFAULT, TERMINAL, PALETTE, RGB };
+  Kind kind = DEFAULT;
+  // TERMINAL: foreground SGR code (30-37, 90-97), PALETTE: 0-255,
+  // RGB: 0xRRGGBB.
+  uint32_t value = 0;
+
+  constexpr bool operator==(const Color &) const = default;
+
+  static constexpr Color from(fmt::detail::color_type c) {
+    return c.is_rgb ? Color{RGB, c.value.rgb_color}
+                    : Color{TERMINAL, c.value.term_color};
+  }
+};
+
+// Terminal attribute state, i.e. what SGR sequences have switched on.
+struct Attributes {
+  uint8_t emphasis = 0; // fmt::emphasis bits
+  Color fg;
+  Color bg;
+
+  constexpr bool operator==(const Attributes &) const = default;
+  constexpr bool empty() const { return *this == Attributes{}; }
+
+  // Layers `style` on top: emphasis adds up, colors are replaced.
+  constexpr Attributes &operator|=(const fmt::text_style &style) {
+    if (style.has_emphasis())
+      emphasis |= static_cast<uint8_t>(style.get_emphasis());
+    if (style.has_foreground())
+      fg = Color::from(style.get_foreground());
+    if (style.has_background())
+      bg = Color::from(style.get_background());
+    return *this;
+  }
+
+  constexpr Attributes &operator|=(const Attributes &style) {
+    emphasis |= style.emphasis;
+    if (style.fg.kind != Color::DEFAULT)
+      fg = style.fg;
+    if (style.bg.kind != Color::DEFAULT)
+      bg = style.bg;
+    return *this;
+  }
+};
+
+// Nearest-color downgrades to the xterm default palette, for terminals
+// without truecolor. rgb to 256 picks the nearer of the closest cube and
+// gray entries from per-channel tables; rgb to 16 is one lookup in a table
+// over 5 bits per channel, built on first use.
+class Palette {
+public:
+  static constexpr uint32_t SYSTEM[16] = {
+      0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd,
+      0x00cdcd, 0xe5e5e5, 0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00,
+      0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff};
+  static constexpr uint8_t LEVELS[6] = {0, 95, 135, 175, 215, 255};
+
+  // RGB value of palette entry `i`.
+  static constexpr uint32_t rgb(uint8_t i) {
+    if (i < 16)
+      return SYSTEM[i];
+    if (i >= 232) {
+      uint32_t v = 8 + 10 * (i - 232);
+      return v << 16 | v << 8 | v;
+    }
+    i -= 16;
+    return static_cast<uint32_t>(LEVELS[i / 36]) << 16 |
+           LEVELS[i / 6 % 6] << 8 | LEVELS[i % 6];
+  }
+
+  static constexpr uint8_t to256(uint32_t c) {
+    uint8_t r = c >> 16 & 0xff, g = c >> 8 & 0xff, b = c & 0xff;
+    uint8_t cube = 16 + 36 * CUBE[r] + 6 * CUBE[g] + CUBE[b];
+    uint8_t gray = 232 + GRAY[(r + g + b) / 3];
+    return distance(c, rgb(gray)) < distance(c, rgb(cube)) ? gray : cube;
+  }
+
+  // Index 0-15 of the nearest system color.
+  static constexpr uint8_t to16(uint32_t c) {
+    if (std::is_constant_evaluated())
+      return nearest16(c);
+    return table16()[(c >> 19 & 0x1f) << 10 | (c >> 11 & 0x1f) << 5 |
+                     (c >> 3 & 0x1f)];
+  }
+
+  // `c` as `mode` can show it. TERMINAL colors are left alone.
+  static constexpr Color convert(const Color &c, ColorMode mode) {
+    if (mode == ColorMode::ANSI256 && c.kind == Color::RGB)
+      return Color{Color::PALETTE, to256(c.value)};
+    if (mode != ColorMode::ANSI16)
+      return c;
+    if (c.kind == Color::RGB)
+      return terminal(to16(c.value));
+    if (c.kind == Color::PALETTE)
+      return terminal(c.value < 16 ? c.value : to16(rgb(c.value)));
+    return c;
+  }
+
+  static constexpr Attributes convert(Attributes attrs, ColorMode mode) {
+    attrs.fg = convert(attrs.fg, mode);
+    attrs.bg = convert(attrs.bg, mode);
+    return attrs;
+  }
+
+private:
+  static constexpr auto CUBE = [] {
+    std::array<uint8_t, 256> t{};
+    for (int v = 0; v < 256; v++) {
+      for (uint8_t i = 1; i < 6; i++) {
+        if (std::abs(LEVELS[i] - v) < std::abs(LEVELS[t[v]] - v))
+          t[v] = i;
+      }
+    }
+    return t;
+  }();
+
+  // Nearest of the 24 grays 8, 18, ..., 238.
+  static constexpr auto GRAY = [] {
+    std::array<uint8_t, 256> t{};
+    for (int v = 0; v < 256; v++)
+      t[v] = static_cast<uint8_t>(std::clamp((v - 3) / 10, 0, 23));
+    return t;
+  }();
+
+  static constexpr int distance(uint32_t a, uint32_t b) {
+    int dr = static_cast<int>(a >> 16 & 0xff) - static_cast<int>(b >> 16 & 0xff);
+    int dg = static_cast<int>(a >> 8 & 0xff) - static_cast<int>(b >> 8 & 0xff);
+    int db = static_cast<int>(a & 0xff) - static_cast<int>(b & 0xff);
+    return dr * dr + dg * dg + db * db;
+  }
+
+  static constexpr uint8_t nearest16(uint32_t c) {
+    uint8_t best = 0;
+    for (uint8_t i = 1; i < 16; i++) {
+      if (distance(c, SYSTEM[i]) < distance(c, SYSTEM[best]))
+        best = i;
+    }
+    return best;
+  }
+
+  static const std::array<uint8_t, 1 << 15> &table16() {
+    static const auto table = [] {
+      std::array<uint8_t, 1 << 15> t{};
+      for (uint32_t i = 0; i < t.size(); i++) {
+        // Center of the cell.
+        auto r = (i >> 10) << 3 | 4, g = (i >> 5 & 0x1f) << 3 | 4,
+             b = (i & 0x1f) << 3 | 4;
+        t[i] = nearest16(r << 16 | g << 8 | b);
+      }
+      return t;
+    }();
+    return table;
+  }
+
+  static constexpr Color terminal(uint32_t index) {
+    return Color{Color::TERMINAL, index < 8 ? 30 + index : 90 + index - 8};
+  }
+};
+
+// What the terminal on the other end of a file descriptor can show.
+class Terminal {
+public:
+  // NO_COLOR turns colors off. FORCE_COLOR=0..3 picks NONE, ANSI16,
+  // ANSI256 or TRUECOLOR, and any other value skips the isatty() check.
+  // Otherwise COLORTERM and TERM decide.
+  static ColorMode detect(int fd) {
+    auto env = [](const char *name) {
+      auto value = std::getenv(name);
+      return std::string_view(value ? value : "");
+    };
+    if (!env("NO_COLOR").empty())
+      return ColorMode::NONE;
+    auto force = env("FORCE_COLOR");
+    if (force.size() == 1 && force[0] >= '0' && force[0] <= '3')
+      return static_cast<ColorMode>(force[0] - '0');
+    if (force.empty() && !isatty(fd))
+      return ColorMode::NONE;
+    auto colorterm = env("COLORTERM");
+    if (colorterm == "truecolor" || colorterm == "24bit")
+      return ColorMode::TRUECOLOR;
+    auto term = env("TERM");
+    if (term == "dumb")
+      return ColorMode::NONE;
+    if (term.ends_with("-direct"))
+      return ColorMode::TRUECOLOR;
+    if (term.find("256") != std::string_view::npos)
+      return ColorMode::ANSI256;
+    return ColorMode::ANSI16;
+  }
+
+  // Mode of stdout, detected once. Style helpers and new printers use it.
+  static ColorMode colorMode() { return mode().load(std::memory_order_relaxed); }
+  static void setColorMode(ColorMode m) { mode().store(m); }
+
+private:
+  static std::atomic<ColorMode> &mode() {
+    static std::atomic<ColorMode> m{detect(STDOUT_FILENO)};
+    return m;
+  }
+};
+
+// Application-defined markup tags (e.g. <warn>, <ok>) mapped to precomputed
+// styles. Open addressing on peg::str2tag, so a lookup is one hash of the
+// name and usually a single probe. Register tags before rendering from other
+// threads.
+class TagRegistry {
+public:
+  static constexpr std::size_t CAPACITY = 256;
+
+  static TagRegistry &instance() {
+    static TagRegistry registry;
+    return registry;
+  }
+
+  // Adds or replaces a tag. Fails for names that are not [a-zA-Z]+ and once
+  // the table is half full.
+  bool add(std::string_view name, const fmt::text_style &style) {
+    if (name.empty() ||
+        !std::all_of(name.begin(), name.end(), [](char c) {
+          return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        }))
+      return false;
+    Attributes attrs;
+    attrs |= style;
+    auto &entry = entries[slot(name)];
+    if (!entry.used) {
+      if (count == CAPACITY / 2)
+        return false;
+      count++;
+      entry.used = true;
+      entry.hash = str2tag(name);
+      entry.name = name;
+    }
+    entry.style = attrs;
+    return true;
+  }
+
+  const Attributes *find(std::string_view name) const {
+    if (count == 0)
+      return nullptr;
+    auto &entry = entries[slot(name)];
+    return entry.used ? &entry.style : nullptr;
+  }
+
+private:
+  struct Entry {
+    bool used = false;
+    unsigned int hash = 0;
+    std::string name;
+    Attributes style;
+  };
+
+  // The entry holding `name`, or the free slot where it would go.
+  std::size_t slot(std::string_view name) const {
+    auto hash = str2tag(name);
+    for (std::size_t i = hash % CAPACITY;; i = (i + 1) % CAPACITY) {
+      auto &entry = entries[i];
+      if (!entry.used || (entry.hash == hash && entry.name == name))
+        return i;
+    }
+  }
+
+  std::array<Entry, CAPACITY> entries;
+  std::size_t count = 0;
+};
+
+// ANSI escape sequences: scanning, SGR state tracking and minimal SGR
+// transitions between two attribute states.
+class Ansi {
+public:
+  enum class Scan { OK, INVALID, INCOMPLETE };
+
+  struct Escape {
+    std::string_view params;
+    char final = 0;
+    bool csi = false;
+  };
+
+  // SGR codes that switch each fmt::emphasis bit on and off.
+  static constexpr uint8_t EMPHASIS_ON[] = {1, 2, 3, 4, 5, 7, 8, 9};
+  static constexpr uint8_t EMPHASIS_OFF[] = {22, 22, 23, 24, 25, 27, 28, 29};
+
+  // Scans the escape sequence `p` points at (ESC). On OK `p` is moved past
+  // it.
+  static constexpr Scan scanEscape(const char *&p, const char *end,
+                                   Escape &esc) {
+    auto s = p + 1;
+    if (s == end)
+      return Scan::INCOMPLETE;
+    if (*s == ']' || *s == 'P' || *s == 'X' || *s == '^' || *s == '_')
+      return scanString(p, end, esc);
+    if (*s != '[') {
+      if (*s < 0x30 || *s > 0x7e)
+        return Scan::INVALID;
+      esc = Escape{{}, *s, false};
+      p = s + 1;
+      return Scan::OK;
+    }
+    auto params = ++s;
+    while (s < end && *s >= 0x20 && *s <= 0x3f)
+      s++;
+    if (s == end)
+      return Scan::INCOMPLETE;
+    if (*s < 0x40 || *s > 0x7e)
+      return Scan::INVALID;
+    esc = Escape{std::string_view(params, s - params), *s, true};
+    p = s + 1;
+    return Scan::OK;
+  }
+
+  // OSC, DCS and the other string sequences run up to ST (ESC \); OSC may
+  // also end with BEL. `params` is the payload, `final` the introducer.
+  static constexpr Scan scanString(const char *&p, const char *end,
+                                   Escape &esc) {
+    auto introducer = p[1];
+    auto payload = p + 2;
+    for (auto s = payload; s < end; s++) {
+      if (*s == '\a' && introducer == ']') {
+        esc = Escape{std::string_view(payload, s - payload), introducer, false};
+        p = s + 1;
+        return Scan::OK;
+      }
+      if (*s == '\x1b') {
+        if (s + 1 == end)
+          return Scan::INCOMPLETE;
+        if (s[1] != '\\')
+          return Scan::INVALID;
+        esc = Escape{std::string_view(payload, s - payload), introducer, false};
+        p = s + 2;
+        return Scan::OK;
+      }
+    }
+    return Scan::INCOMPLETE;
+  }
+
+  // Calls `f(begin, end)` for each run of text between escape sequences.
+  // Incomplete or invalid sequences are kept as text.
+  template <typename F> static void eachText(std::string_view text, F f) {
+    auto p = text.data();
+    auto end = p + text.size();
+    while (p < end) {
+      auto next = Simd::find(p, end, '\x1b');
+      if (next != p)
+        f(p, next);
+      p = next;
+      if (p == end)
+        break;
+      Escape esc;
+      auto start = p;
+      if (scanEscape(p, end, esc) != Scan::OK) {
+        p++;
+        f(start, p);
+      }
+    }
+  }
+
+  template <typename OutputIt>
+  static OutputIt strip(std::string_view text, OutputIt out) {
+    eachText(text, [&](auto b, auto e) { out = std::copy(b, e, out); });
+    return out;
+  }
+
+  static void strip(std::string &text) {
+    auto begin = text.data();
+    auto first = Simd::find(begin, begin + text.size(), '\x1b');
+    if (first == begin + text.size())
+      return;
+    auto out = const_cast<char *>(first);
+    eachText(std::string_view(first, begin + text.size() - first),
+             [&](auto b, auto e) {
+               std::memmove(out, b, e - b);
+               out += e - b;
+             });
+    text.resize(out - begin);
+  }
+
+  static std::size_t strippedLength(std::string_view text) {
+    std::size_t n = 0;
+    eachText(text, [&](auto b, auto e) { n += e - b; });
+    return n;
+  }
+
+  static constexpr bool isSgr(const Escape &esc) {
+    return esc.csi && esc.final == 'm';
+  }
+
+  // Splits SGR parameters into `codes`. Returns 0 for parameters that are
+  // not numbers.
+  static constexpr std::size_t parseSgr(std::string_view params,
+                                        uint32_t (&codes)[32]) {
+    std::size_t n = 0;
+    uint32_t value = 0;
+    for (auto c : params) {
+      if (c >= '0' && c <= '9') {
+        value = value * 10 + (c - '0');
+      } else if (c == ';' || c == ':') {
+        if (n < std::size(codes))
+          codes[n++] = value;
+        value = 0;
+      } else {
+        return 0;
+      }
+    }
+    if (n < std::size(codes))
+      codes[n++] = value;
+    return n;
+  }
+
+  // Applies SGR parameters to `attrs`. Code 0 goes back to `reset`.
+  static constexpr void applySgr(std::string_view params, Attributes &attrs,
+                                 const Attributes &reset) {
+    uint32_t codes[32]{};
+    auto n = parseSgr(params, codes);
+
+    for (std::size_t i = 0; i < n; i++) {
+      auto code = codes[i];
+      if (code == 0) {
+        attrs = reset;
+      } else if (code <= 9) {
+        for (int bit = 0; bit < 8; bit++) {
+          if (EMPHASIS_ON[bit] == code || (code == 6 && bit == 4))
+            attrs.emphasis |= 1 << bit;
+        }
+      } else if (code >= 22 && code <= 29) {
+        for (int bit = 0; bit < 8; bit++) {
+          if (EMPHASIS_OFF[bit] == code)
+            attrs.emphasis &= ~(1 << bit);
+        }
+      } else if ((code >= 30 && code <= 37) || (code >= 90 && code <= 97)) {
+        attrs.fg = Color{Color::TERMINAL, code};
+      } else if ((code >= 40 && code <= 47) || (code >= 100 && code <= 107)) {
+        attrs.bg = Color{Color::TERMINAL, code - 10};
+      } else if (code == 39) {
+        attrs.fg = Color{};
+      } else if (code == 49) {
+        attrs.bg = Color{};
+      } else if (code == 38 || code == 48) {
+        Color color;
+        if (i + 2 < n && codes[i + 1] == 5) {
+          color = Color{Color::PALETTE, codes[i + 2] & 0xff};
+          i += 2;
+        } else if (i + 4 < n && codes[i + 1] == 2) {
+          color = Color{Color::RGB, (codes[i + 2] & 0xff) << 16 |
+                                        (codes[i + 3] & 0xff) << 8 |
+                                        (codes[i + 4] & 0xff)};
+          i += 4;
+        } else {
+          return;
+        }
+        (code == 38 ? attrs.fg : attrs.bg) = color;
+      }
+    }
+  }
+
+  template <typename Out>
+  static constexpr void writeNumber(uint32_t value, Out &out) {
+    char digits[10]{};
+    auto p = digits + sizeof(digits);
+    do {
+      *--p = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    out.append(p, digits + sizeof(digits));
+  }
+
+  template <typename Out> struct Params {
+    Out &out;
+    bool first = true;
+    constexpr void add(uint32_t code) {
+      if (!first)
+        out.append(";", ";" + 1);
+      first = false;
+      writeNumber(code, out);
+    }
+  };
+
+  template <typename Out>
+  static constexpr void writeColor(const Color &color, bool background,
+                                   Params<Out> &params) {
+    switch (color.kind) {
+    case Color::DEFAULT:
+      params.add(background ? 49 : 39);
+      break;
+    case Color::TERMINAL:
+      params.add(color.value + (background ? 10 : 0));
+      break;
+    case Color::PALETTE:
+      params.add(background ? 48 : 38);
+      params.add(5);
+      params.add(color.value);
+      break;
+    case Color::RGB:
+      params.add(background ? 48 : 38);
+      params.add(2);
+      params.add(color.value >> 16 & 0xff);
+      params.add(color.value >> 8 & 0xff);
+      params.add(color.value & 0xff);
+      break;
+    }
+  }
+
+  // SGR parameters that turn `from` into `to`.
+  template <typename Out>
+  static constexpr void writeParams(const Attributes &from,
+                                    const Attributes &to, Out &out) {
+    Params<Out> params{out};
+    uint8_t off = from.emphasis & ~to.emphasis;
+    uint8_t on = to.emphasis & ~from.emphasis;
+    // 22 switches off both bold and faint.
+    if (off & 0b11) {
+      params.add(22);
+      on |= to.emphasis & 0b11;
+    }
+    for (int bit = 2; bit < 8; bit++) {
+      if (off & 1 << bit)
+        params.add(EMPHASIS_OFF[bit]);
+    }
+    for (int bit = 0; bit < 8; bit++) {
+      if (on & 1 << bit)
+        params.add(EMPHASIS_ON[bit]);
+    }
+    if (from.fg != to.fg)
+      writeColor(to.fg, false, params);
+    if (from.bg != to.bg)
+      writeColor(to.bg, true, params);
+  }
+
+  // Shortest single SGR sequence that turns `from` into `to`: either the
+  // changed parameters or a reset followed by everything `to` sets. Colors
+  // are converted for `mode` first, so changes it can't show cost nothing.
+  template <typename Out>
+  static constexpr void writeTransition(const Attributes &from,
+                                        const Attributes &to, Out &out,
+                                        ColorMode mode = ColorMode::TRUECOLOR) {
+    constexpr std::string_view reset = "\x1b[0m";
+    if (mode == ColorMode::NONE)
+      return;
+    if (mode != ColorMode::TRUECOLOR) {
+      writeTransition(Palette::convert(from, mode), Palette::convert(to, mode),
+                      out);
+      return;
+    }
+    if (from == to)
+      return;
+    if (to.empty()) {
+      out.append(reset.data(), reset.data() + reset.size());
+      return;
+    }
+    StaticBuffer<64> diff, full;
+    writeParams(from, to, diff);
+    writeParams(Attributes{}, to, full);
+    out.append("\x1b[", "\x1b[" + 2);
+    if (full.size() + 2 < diff.size()) {
+      out.append("0;", "0;" + 2);
+      out.append(full.text, full.text + full.size());
+    } else {
+      out.append(diff.text, diff.text + diff.size());
+    }
+    out.append("m", "m" + 1);
+  }
+
+  // Converts the colors of each SGR sequence in `text` for `mode`. Every
+  // sequence is rewritten on its own, so `text` may start or end anywhere
+  // in a line; sequences without colors to convert are copied as they are.
+  // NONE drops all escapes, like strip().
+  template <typename Out>
+  static void downgrade(std::string_view text, ColorMode mode, Out &out) {
+    if (mode == ColorMode::NONE) {
+      strip(text, std::back_inserter(out));
+      return;
+    }
+    auto p = text.data();
+    auto end = p + text.size();
+    while (p < end) {
+      auto next = Simd::find(p, end, '\x1b');
+      out.append(p, next);
+      p = next;
+      if (p == end)
+        break;
+      Escape esc;
+      auto start = p;
+      if (scanEscape(p, end, esc) != Scan::OK) {
+        out.append(p, p + 1);
+        p++;
+        continue;
+      }
+      if (!isSgr(esc) || !rewriteColors(esc.params, mode, out))
+        out.append(start, p);
+    }
+  }
+
+  static void downgrade(std::string &text, ColorMode mode) {
+    if (mode == ColorMode::TRUECOLOR ||
+        Simd::find(text.data(), text.data() + text.size(), '\x1b') ==
+            text.data() + text.size())
+      return;
+    thread_local std::string converted;
+    converted.clear();
+    downgrade(std::string_view(text), mode, converted);
+    text.swap(converted);
+  }
+
+private:
+  // Writes the SGR sequence with `params` for `mode`. Returns false, writing
+  // nothing, when it has no colors `mode` can't show.
+  template <typename Out>
+  static bool rewriteColors(std::string_view params, ColorMode mode,
+                            Out &out) {
+    uint32_t codes[32]{};
+    auto n = parseSgr(params, codes);
+    auto extended = [&](std::size_t i) {
+      return (codes[i] == 38 || codes[i] == 48) && i + 1 < n;
+    };
+    bool convert = false;
+    for (std::size_t i = 0; i < n && !convert; i++) {
+      convert = extended(i) && (codes[i + 1] == 2 ||
+                                (codes[i + 1] == 5 && mode == ColorMode::ANSI16));
+    }
+    if (!convert || mode == ColorMode::TRUECOLOR)
+      return false;
+
+    out.append("\x1b[", "\x1b[" + 2);
+    Params<Out> sgr{out};
+    for (std::size_t i = 0; i < n; i++) {
+      Color color;
+      if (extended(i) && codes[i + 1] == 5 && i + 2 < n) {
+        color = Color{Color::PALETTE, codes[i + 2] & 0xff};
+      } else if (extended(i) && codes[i + 1] == 2 && i + 4 < n) {
+        color = Color{Color::RGB, (codes[i + 2] & 0xff) << 16 |
+                                      (codes[i + 3] & 0xff) << 8 |
+                                      (codes[i + 4] & 0xff)};
+      } else {
+        sgr.add(codes[i]);
+        continue;
+      }
+      writeColor(Palette::convert(color, mode), codes[i] == 48, sgr);
+      i += color.kind == Color::PALETTE ? 2 : 4;
+    }
+    out.append("m", "m" + 1);
+    return true;
+  }
+};
+
+// Terminal columns taken by UTF-8 text. Escape sequences take none. Emoji
+// ZWJ sequences, skin tone modifiers, flags and VS16 are counted as one
+// cluster the way most terminals draw them.
+class DisplayWidth {
+public:
+  // Columns of a single code point: 0, 1 or 2.
+  static constexpr int codepoint(char32_t c) {
+    if (c < 0x7f)
+      return c >= 0x20;
+    if (c < 0xa0)
+      return 0;
+    if (c < 0x300)
+      return 1;
+    if (inTable(ZERO_WIDTH_RANGES, c))
+      return 0;
+    if (inTable(WIDE_RANGES, c))
+      return 2;
+    return 1;
+  }
+
+  static std::size_t of(std::string_view text) {
+    std::size_t width = 0;
+    Cluster cluster;
+    auto p = text.data();
+    auto end = p + text.size();
+    while (p < end) {
+      auto ascii = Simd::skipAscii(p, end);
+      if (ascii != p) {
+        width += ascii - p;
+        cluster = Cluster{1};
+        p = ascii;
+        if (p == end)
+          break;
+      }
+      if (*p == '\x1b') {
+        Ansi::Escape esc;
+        if (Ansi::scanEscape(p, end, esc) != Ansi::Scan::OK)
+          p++;
+        continue;
+      }
+      width += cluster.add(decode(p, end));
+    }
+    return width;
+  }
+
+  // Decodes the UTF-8 sequence at `p` and moves past it. ASCII bytes decode
+  // to themselves; malformed input decodes to U+FFFD one byte at a time.
+  static constexpr char32_t decode(const char *&p, const char *end) {
+    auto b = static_cast<unsigned char>(*p++);
+    if (b < 0x80)
+      return b;
+    int n = b >= 0xf0 ? 3 : b >= 0xe0 ? 2 : b >= 0xc0 ? 1 : -1;
+    if (n < 0 || b >= 0xf8 || end - p < n)
+      return 0xfffd;
+    char32_t c = b & (0x3f >> n);
+    for (int i = 0; i < n; i++) {
+      auto cb = static_cast<unsigned char>(p[i]);
+      if ((cb & 0xc0) != 0x80)
+        return 0xfffd;
+      c = c << 6 | (cb & 0x3f);
+    }
+    p += n;
+    return c;
+  }
+
+  // Grapheme state for counting columns one code point at a time.
+  struct Cluster {
+    int last = 0;
+    bool joiner = false;
+    bool flag = false;
+
+    // Columns `c` adds to the current line.
+    constexpr int add(char32_t c) {
+      if (c == 0x200d) {
+        joiner = true;
+        return 0;
+      }
+      if (c == 0xfe0f && last == 1) {
+        last = 2;
+        return 1;
+      }
+      auto width = codepoint(c);
+      if (width == 0)
+        return 0;
+      if ((joiner && last == 2) || (c >= 0x1f3fb && c <= 0x1f3ff && last == 2)) {
+        joiner = false;
+        return 0;
+      }
+      joiner = false;
+      if (c >= 0x1f1e6 && c <= 0x1f1ff) {
+        flag = !flag;
+        last = 2;
+        return flag ? 2 : 0;
+      }
+      flag = false;
+      last = width;
+      return width;
+    }
+  };
+
+private:
+  template <std::size_t N>
+  static constexpr bool inTable(const WidthRange (&table)[N], char32_t c) {
+    auto it = std::upper_bound(
+        table, table + N, c,
+        [](char32_t c, const WidthRange &r) { return c < r.first; });
+    return it != table && c <= (it - 1)->last;
+  }
+};
+
+// The rows of a live region (e.g. a status bar) as the terminal shows them,
+// cell by cell. A new frame is diffed against the last one and only the
+// cells that changed are written. The cursor is kept at the start of the
+// line below the region, and every frame ends with the attributes reset.
+class Screen {
+public:
+  struct Cell {
+    // Empty for the second column of a wide character.
+    std::string text;
+    Attributes attrs;
+
+    bool operator==(const Cell &) const = default;
+  };
+  using Row = std::vector<Cell>;
+
+  // Unchanged cells shorter than this between two changes are rewritten
+  // rather than skipped with a cursor move.
+  static constexpr std::size_t GAP = 4;
+
+  // Splits a rendered line into cells. SGR sequences set the attributes of
+  // the cells after them; other escapes and control characters are dropped.
+  static void parse(std::string_view line, Row &row) {
+    row.clear();
+    Attributes attrs;
+    DisplayWidth::Cluster cluster;
+    auto p = line.data();
+    auto end = p + line.size();
+    while (p < end) {
+      if (*p == '\x1b') {
+        Ansi::Escape esc;
+        if (Ansi::scanEscape(p, end, esc) != Ansi::Scan::OK)
+          p++;
+        else if (Ansi::isSgr(esc))
+          Ansi::applySgr(esc.params, attrs, Attributes{});
+        continue;
+      }
+      auto start = p;
+      auto c = DisplayWidth::decode(p, end);
+      if (c < 0x20 || c == 0x7f)
+        continue;
+      auto width = cluster.add(c);
+      std::string_view text(start, p - start);
+      // Combining marks, joined emoji and the second flag letter belong to
+      // the cell before.
+      if ((width == 0 || DisplayWidth::codepoint(c) == 0) && !row.empty()) {
+        auto lead = row.size() - 1;
+        while (lead > 0 && row[lead].text.empty())
+          lead--;
+        row[lead].text += text;
+      } else if (width > 0) {
+        row.push_back(Cell{std::string(text), attrs});
+        width--;
+      }
+      for (; width > 0; width--)
+        row.push_back(Cell{"", attrs});
+    }
+  }
+
+  std::size_t height() const { return frame.size(); }
+
+  // Appends what turns the last frame into `rows` to `out`. Frames of
+  // another height are redrawn in full; otherwise rows whose text is the
+  // same as last time are skipped without being parsed.
+  void draw(const std::vector<std::string_view> &rows, std::string &out) {
+    if (rows.size() != frame.size()) {
+      clear(out);
+      frame.resize(rows.size());
+      sources.resize(rows.size());
+      for (std::size_t r = 0; r < rows.size(); r++) {
+        sources[r] = rows[r];
+        parse(rows[r], frame[r]);
+        drawRow(frame[r], out);
+      }
+      return;
+    }
+    diff(rows, out);
+  }
+
+  // Appends `lines` (whole lines) above the region, then redraws the
+  // region below them.
+  void print(std::string_view lines, const std::vector<std::string_view> &rows,
+             std::string &out) {
+    clear(out);
+    out += lines;
+    draw(rows, out);
+  }
+
+  // Erases the region and forgets it; the cursor ends where it started.
+  void clear(std::string &out) {
+    if (!frame.empty())
+      out += fmt::format("\x1b[{}A\x1b[J", frame.size());
+    frame.clear();
+    sources.clear();
+  }
+
+private:
+  std::vector<Row> frame;
+  // The text each row of `frame` was parsed from.
+  std::vector<std::string> sources;
+  Row next;
+
+  static void drawRow(const Row &row, std::string &out) {
+    Attributes emitted;
+    for (auto &cell : row) {
+      Ansi::writeTransition(emitted, cell.attrs, out);
+      emitted = cell.attrs;
+      out += cell.text;
+    }
+    Ansi::writeTransition(emitted, Attributes{}, out);
+    out += '\n';
+  }
+
+  void diff(const std::vector<std::string_view> &rows, std::string &out) {
+    auto line = frame.size();
+    auto moveTo = [&](std::size_t r) {
+      if (r < line)
+        out += fmt::format("\x1b[{}A", line - r);
+      else if (r > line)
+        out += fmt::format("\x1b[{}B", r - line);
+      line = r;
+    };
+    Attributes emitted;
+    auto write = [&](const Cell &cell) {
+      Ansi::writeTransition(emitted, cell.attrs, out);
+      emitted = cell.attrs;
+      out += cell.text;
+    };
+    for (std::size_t r = 0; r < rows.size(); r++) {
+      if (rows[r] == sources[r])
+        continue;
+      sources[r] = rows[r];
+      parse(rows[r], next);
+      auto &from = frame[r];
+      auto &to = next;
+      auto changed = [&](std::size_t i) {
+        return i >= from.size() || from[i] != to[i];
+      };
+      for (std::size_t i = 0; i < to.size(); i++) {
+        if (!changed(i))
+          continue;
+        while (i > 0 && to[i].text.empty())
+          i--;
+        auto stop = i + 1;
+        for (auto k = stop; k < to.size() && k < stop + GAP; k++) {
+          if (changed(k))
+            stop = k + 1;
+        }
+        while (stop < to.size() && to[stop].text.empty())
+          stop++;
+        moveTo(r);
+        out += fmt::format("\x1b[{}G", i + 1);
+        for (; i < stop; i++)
+          write(to[i]);
+        i--;
+      }
+      if (to.size() < from.size()) {
+        moveTo(r);
+        write(Cell{});
+        out += fmt::format("\x1b[{}G\x1b[K", to.size() + 1);
+      }
+      from.swap(next);
+    }
+    write(Cell{});
+    if (line != frame.size()) {
+      moveTo(frame.size());
+      out += '\r';
+    }
+  }
+};
+
+// Single-pass markup renderer. Tags are scanned straight from the input and
+// the active styles are kept on a fixed-size stack, so no AST and no
+// per-element strings are built. SGR sequences already present in the text
+// are folded into the current style, and escapes are only written right
+// before visible text, as the difference from what the terminal already
+// has. The visible text matches utils::parsePeg.
+class MarkupRenderer {
+public:
+  static constexpr int MAX_DEPTH = 64;
+
+  struct Tag {
+    std::string_view name;
+    std::string_view arg;
+    bool closing = false;
+  };
+
+  enum class TagScan { OK, INVALID, INCOMPLETE };
+
+  static constexpr bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+  static constexpr bool isAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  }
+
+  // Scans the tag `p` points at ('<'). On OK `p` is moved past the '>'.
+  // INCOMPLETE means the input ended before the tag did.
+  static constexpr TagScan scanTag(const char *&p, const char *end, Tag &tag) {
+    auto s = p + 1;
+    auto skipSpaces = [&] {
+      while (s < end && isSpace(*s))
+        s++;
+    };
+    tag.closing = s < end && *s == '/';
+    if (tag.closing)
+      s++;
+    skipSpaces();
+    auto name = s;
+    while (s < end && isAlpha(*s))
+      s++;
+    tag.name = std::string_view(name, s - name);
+    skipSpaces();
+    tag.arg = {};
+    if (!tag.closing && s < end && *s == '=') {
+      auto arg = ++s;
+      while (s < end && *s != '>')
+        s++;
+      tag.arg = std::string_view(arg, s - arg);
+    }
+    skipSpaces();
+    if (s == end)
+      return TagScan::INCOMPLETE;
+    if (*s != '>')
+      return TagScan::INVALID;
+    p = s + 1;
+    return TagScan::OK;
+  }
+
+  // "#rrggbb" or "#rgb", the '#' optional. Anything else is not a color.
+  static constexpr std::optional<uint32_t> parseHex(std::string_view arg) {
+    if (!arg.empty() && arg[0] == '#')
+      arg.remove_prefix(1);
+    if (arg.size() != 3 && arg.size() != 6)
+      return std::nullopt;
+    uint32_t value = 0;
+    for (auto c : arg) {
+      uint32_t digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+      } else {
+        return std::nullopt;
+      }
+      value = value * 16 + digit;
+      if (arg.size() == 3)
+        value = value * 16 + digit;
+    }
+    return value;
+  }
+
+  // Built-in tags, dispatched on the peglib tag hash. The name is compared
+  // once more after the switch since other names can share a hash.
+  static constexpr bool builtinTag(const Tag &tag, Attributes &style) {
+    std::string_view name;
+    fmt::text_style add;
+    switch (str2tag(tag.name)) {
+    case "b"_:
+      name = "b";
+      add = fmt::emphasis::bold;
+      break;
+    case "u"_:
+      name = "u";
+      add = fmt::emphasis::underline;
+      break;
+    case "i"_:
+      name = "i";
+      add = fmt::emphasis::italic;
+      break;
+    case "s"_:
+      name = "s";
+      add = fmt::emphasis::strikethrough;
+      break;
+    case "red"_:
+      name = "red";
+      add = fmt::fg(fmt::terminal_color::red);
+      break;
+    case "black"_:
+      name = "black";
+      add = fmt::fg(fmt::terminal_color::black);
+      break;
+    case "green"_:
+      name = "green";
+      add = fmt::fg(fmt::terminal_color::green);
+      break;
+    case "yellow"_:
+      name = "yellow";
+      add = fmt::fg(fmt::terminal_color::yellow);
+      break;
+    case "blue"_:
+      name = "blue";
+      add = fmt::fg(fmt::terminal_color::blue);
+      break;
+    case "magenta"_:
+      name = "magenta";
+      add = fmt::fg(fmt::terminal_color::magenta);
+      break;
+    case "cyan"_:
+      name = "cyan";
+      add = fmt::fg(fmt::terminal_color::cyan);
+      break;
+    case "gray"_:
+      name = "gray";
+      add = fmt::fg(fmt::color::gray);
+      break;
+    // An element with an invalid color keeps the color around it.
+    case "color"_:
+      name = "color";
+      if (auto rgb = parseHex(tag.arg))
+        add = fmt::fg(fmt::rgb(*rgb));
+      break;
+    case "bgcolor"_:
+      name = "bgcolor";
+      if (auto rgb = parseHex(tag.arg))
+        add = fmt::bg(fmt::rgb(*rgb));
+      break;
+    default:
+      return false;
+    }
+    if (tag.name != name)
+      return false;
+    style |= add;
+    return true;
+  }
+
+  static constexpr bool isBuiltinTag(std::string_view name) {
+    Attributes style;
+    return builtinTag(Tag{name, {}}, style);
+  }
+
+  // Style of an element opened with `tag` inside an element styled with
+  // `style`. Inner colors replace outer ones, unknown tags inherit.
+  // Registered tags are only known at runtime.
+  static constexpr Attributes applyTag(const Tag &tag, Attributes style) {
+    if (!builtinTag(tag, style) && !std::is_constant_evaluated()) {
+      if (auto registered = TagRegistry::instance().find(tag.name))
+        style |= *registered;
+    }
+    return style;
+  }
+
+  // Returns the end of the fmt replacement field (or "{{" escape) at `p`.
+  static constexpr const char *skipField(const char *p, const char *end) {
+    if (p + 1 < end && p[1] == '{')
+      return p + 2;
+    int level = 0;
+    for (; p < end; p++) {
+      if (*p == '{') {
+        level++;
+      } else if (*p == '}' && --level == 0) {
+        return p + 1;
+      }
+    }
+    return end;
+  }
+
+  // `base` is the style the element was opened with, `state` also includes
+  // SGR sequences met in its text since.
+  struct Level {
+    Attributes base;
+    Attributes state;
+  };
+
+  constexpr Level &top() { return levels[std::min(depth, MAX_DEPTH)]; }
+
+  constexpr void open(const Tag &tag) {
+    auto style = applyTag(tag, top().state);
+    depth++;
+    if (depth <= MAX_DEPTH)
+      levels[depth] = Level{style, style};
+  }
+
+  constexpr bool close() {
+    if (depth == 0)
+      return false;
+    depth--;
+    return true;
+  }
+
+  // Brings the terminal to the current style.
+  template <typename Out> constexpr void sync(Out &out) {
+    auto &target = top().state;
+    if (target != emitted) {
+      Ansi::writeTransition(emitted, target, out, colorMode);
+      emitted = target;
+    }
+  }
+
+  // Writes visible text that contains no tags or escapes.
+  template <typename Out>
+  constexpr void write(const char *begin, const char *end, Out &out) {
+    if (begin == end)
+      return;
+    sync(out);
+    out.append(begin, end);
+  }
+
+  // Handles the escape sequence at `p`. SGR sequences update the current
+  // style; anything else (cursor movement, erase) is passed through.
+  template <typename Out>
+  constexpr Ansi::Scan escape(const char *&p, const char *end, Out &out) {
+    Ansi::Escape esc;
+    auto start = p;
+    auto scan = Ansi::scanEscape(p, end, esc);
+    if (scan != Ansi::Scan::OK)
+      return scan;
+    if (Ansi::isSgr(esc)) {
+      auto &level = top();
+      Ansi::applySgr(esc.params, level.state, level.base);
+    } else {
+      sync(out);
+      out.append(start, p);
+    }
+    return scan;
+  }
+
+  // Renders a complete document. Returns false on malformed markup and
+  // leaves the offending position in `errorPos`.
+  template <typename Out>
+  constexpr bool render(std::string_view text, Out &out) {
+    constexpr auto npos = std::string_view::npos;
+    auto p = text.data();
+    auto end = p + text.size();
+    auto tagPos = text.find('<');
+    auto escPos = text.find('\x1b');
+    auto fieldPos = formatString ? text.find('{') : npos;
+    while (p < end) {
+      std::size_t at = p - text.data();
+      if (tagPos < at)
+        tagPos = text.find('<', at);
+      if (escPos < at)
+        escPos = text.find('\x1b', at);
+      if (fieldPos < at)
+        fieldPos = text.find('{', at);
+      auto pos = std::min({tagPos, escPos, fieldPos});
+      auto next = pos == npos ? end : text.data() + pos;
+      write(p, next, out);
+      p = next;
+      if (p == end)
+        break;
+      if (*p == '{') {
+        auto field = skipField(p, end);
+        write(p, field, out);
+        p = field;
+        continue;
+      }
+      if (*p == '\x1b') {
+        if (escape(p, end, out) != Ansi::Scan::OK) {
+          write(p, p + 1, out);
+          p++;
+        }
+        continue;
+      }
+      Tag tag;
+      errorPos = p;
+      if (scanTag(p, end, tag) != TagScan::OK)
+        return false;
+      if (!tag.closing) {
+        open(tag);
+      } else if (!close()) {
+        return false;
+      }
+    }
+    errorPos = end;
+    if (depth != 0)
+      return false;
+    sync(out);
+    return true;
+  }
+
+  // Drops tags and escape sequences and writes only the text, without
+  // tracking any style. Tags are validated the same way as in render().
+  template <typename Out> bool strip(std::string_view text, Out &out) {
+    auto p = text.data();
+    auto end = p + text.size();
+    while (p < end) {
+      auto next = formatString ? Simd::find(p, end, '<', '\x1b', '{')
+                               : Simd::find(p, end, '<', '\x1b');
+      out.append(p, next);
+      p = next;
+      if (p == end)
+        break;
+      if (*p == '{') {
+        auto field = skipField(p, end);
+        out.append(p, field);
+        p = field;
+        continue;
+      }
+      if (*p == '\x1b') {
+        Ansi::Escape esc;
+        if (Ansi::scanEscape(p, end, esc) != Ansi::Scan::OK) {
+          out.append(p, p + 1);
+          p++;
+        }
+        continue;
+      }
+      Tag tag;
+      errorPos = p;
+      if (scanTag(p, end, tag) != TagScan::OK)
+        return false;
+      if (!tag.closing) {
+        depth++;
+      } else if (depth == 0) {
+        return false;
+      } else {
+        depth--;
+      }
+    }
+    errorPos = end;
+    return depth == 0;
+  }
+
+  void logError(std::string_view text) const {
+    std::size_t line = 1, col = 1;
+    for (auto c = text.data(); c < errorPos; c++) {
+      if (*c == '\n') {
+        line++;
+        col = 1;
+      } else {
+        col++;
+      }
+    }
+    std::cerr << "Parse error at " << line << ":" << col << " => "
+              << (errorPos == text.data() + text.size()
+                      ? "unexpected end of input"
+                      : "unexpected tag")
+              << "\n";
+  }
+
+  // Treat the input as an fmt format string: replacement fields are copied
+  // through untouched, so `{:<10}` is not mistaken for a tag.
+  bool formatString = false;
+  // Colors are converted for this mode as they are written.
+  ColorMode colorMode = ColorMode::TRUECOLOR;
+  std::array<Level, MAX_DEPTH + 1> levels{};
+  int depth = 0;
+  // What the escapes written so far have left the terminal with.
+  Attributes emitted;
+  const char *errorPos = nullptr;
+};
+
+// Incremental markup renderer for documents that arrive in chunks. Style
+// state and a tag or escape cut by a chunk boundary are carried over to the
+// next feed(); output goes to `sink` in bounded pieces, so memory stays
+// constant regardless of the document size. Malformed tags are written
+// through as text and stray closing tags are dropped.
+class MarkupStream {
+public:
+  using Sink = std::function<void(std::string_view)>;
+
+  // Longest tag or escape kept while waiting for its end.
+  static constexpr std::size_t MAX_TOKEN_SIZE = 256;
+  static constexpr std::size_t BUFFER_SIZE = 16 * 1024;
+
+  MarkupStream(Sink s) : sink(std::move(s)) {}
+
+  void feed(std::string_view chunk) {
+    while (!pending.empty() && !chunk.empty()) {
+      auto held = pending.size();
+      auto n = std::min(chunk.size(), MAX_TOKEN_SIZE - held);
+      pending.append(chunk.data(), n);
+      const char *p = pending.data();
+      auto scan = token(p, pending.data() + pending.size());
+      if (scan == Ansi::Scan::INCOMPLETE && pending.size() < MAX_TOKEN_SIZE) {
+        chunk.remove_prefix(n);
+      } else if (scan == Ansi::Scan::OK) {
+        chunk.remove_prefix((p - pending.data()) - held);
+        pending.clear();
+      } else {
+        reject(held);
+      }
+    }
+    process(chunk);
+    flush();
+  }
+
+  // Ends the document: an unfinished tag or escape is written as text and open
+  // elements are closed. Returns false if any markup was malformed.
+  bool finish() {
+    while (!pending.empty())
+      reject(pending.size());
+    Output out{*this};
+    while (renderer.close()) {
+    }
+    renderer.sync(out);
+    flush();
+    auto ok = errors == 0;
+    errors = 0;
+    return ok;
+  }
+
+  std::size_t errors = 0;
+
+private:
+  struct Output {
+    MarkupStream &stream;
+    void append(const char *begin, const char *end) {
+      stream.write(std::string_view(begin, end - begin));
+    }
+  };
+
+  void write(std::string_view text) {
+    if (buffer.size() + text.size() > BUFFER_SIZE)
+      flush();
+    if (text.size() > BUFFER_SIZE)
+      return sink(text);
+    buffer.append(text.data(), text.data() + text.size());
+  }
+
+  void flush() {
+    if (buffer.size() == 0)
+      return;
+    sink(std::string_view(buffer.data(), buffer.size()));
+    buffer.clear();
+  }
+
+  // Applies the tag or escape at `p`.
+  Ansi::Scan token(const char *&p, const char *end) {
+    Output out{*this};
+    if (*p == '\x1b')
+      return renderer.escape(p, end, out);
+    MarkupRenderer::Tag tag;
+    switch (MarkupRenderer::scanTag(p, end, tag)) {
+    case MarkupRenderer::TagScan::INCOMPLETE:
+      return Ansi::Scan::INCOMPLETE;
+    case MarkupRenderer::TagScan::INVALID:
+      return Ansi::Scan::INVALID;
+    default:
+      break;
+    }
+    if (!tag.closing) {
+      renderer.open(tag);
+    } else if (!renderer.close()) {
+      errors++;
+    }
+    return Ansi::Scan::OK;
+  }
+
+  // The pending token is not valid: its first byte is text, the rest of
+  // what was held before the current chunk is scanned again.
+  void reject(std::size_t held) {
+    if (pending[0] == '<')
+      errors++;
+    auto text = std::move(pending);
+    pending.clear();
+    Output out{*this};
+    renderer.write(text.data(), text.data() + 1, out);
+    process(std::string_view(text).substr(1, held - 1));
+  }
+
+  void process(std::string_view text) {
+    Output out{*this};
+    auto p = text.data();
+    auto end = p + text.size();
+    auto tagPos = text.find('<');
+    auto escPos = text.find('\x1b');
+    while (p < end) {
+      std::size_t at = p - text.data();
+      if (tagPos < at)
+        tagPos = text.find('<', at);
+      if (escPos < at)
+        escPos = text.find('\x1b', at);
+      auto pos = std::min(tagPos, escPos);
+      auto next = pos == std::string_view::npos ? end : text.data() + pos;
+      renderer.write(p, next, out);
+      p = next;
+      if (p == end)
+        break;
+      auto start = p;
+      auto scan = token(p, end);
+      if (scan == Ansi::Scan::INCOMPLETE &&
+          std::size_t(end - start) < MAX_TOKEN_SIZE) {
+        pending.assign(start, end);
+        return;
+      }
+      if (scan != Ansi::Scan::OK) {
+        if (*start == '<')
+          errors++;
+        renderer.write(start, start + 1, out);
+        p = start + 1;
+      }
+    }
+  }
+
+  Sink sink;
+  MarkupRenderer renderer;
+  std::string pending;
+  fmt::memory_buffer buffer;
+};
+
+// Bounded LRU cache of compiled markup keyed by the source string. Markup
+// output only depends on the source, so an entry holds the final bytes and a
+// hit is one lookup plus one copy. Strings are only admitted on their second
+// miss, which keeps one-off lines (timestamps, counters) from flushing it.
+//
+// Keys are spread over SHARDS independent LRUs by hash, each with its own
+// lock, so threads rendering different lines rarely wait on each other.
+class MarkupCache {
+public:
+  struct Stats {
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t evictions = 0;
+    std::size_t size = 0;
+    std::size_t capacity = 0;
+  };
+
+  static constexpr std::size_t MAX_KEY_SIZE = 4096;
+  static constexpr std::size_t SHARDS = 16;
+
+  MarkupCache(std::size_t c = 256) { setCapacity(c); }
+
+  // `compile(text, out)` renders `text` into `out` and returns false if the
+  // markup is invalid. Invalid markup is never cached.
+  template <typename Out, typename F>
+  bool render(std::string_view text, Out &out, F compile) {
+    auto hash = std::hash<std::string_view>{}(text);
+    auto &shard = shards[hash % SHARDS];
+    bool admit;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.index.find(text);
+      if (it != shard.index.end()) {
+        shard.stats.hits++;
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        auto &output = it->second->output;
+        out.append(output.data(), output.data() + output.size());
+        return true;
+      }
+      shard.stats.misses++;
+      auto &seen = shard.admitted[hash / SHARDS % shard.admitted.size()];
+      admit = shard.capacity > 0 && text.size() <= MAX_KEY_SIZE && seen == hash;
+      seen = hash;
+    }
+    // Misses compile without the lock.
+    if (!admit)
+      return compile(text, out);
+
+    std::string output;
+    if (!compile(text, output))
+      return false;
+    out.append(output.data(), output.data() + output.size());
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.capacity == 0 || shard.index.find(text) != shard.index.end())
+      return true;
+    shard.entries.push_front(Entry{std::string(text), std::move(output)});
+    shard.index.emplace(shard.entries.front().key, shard.entries.begin());
+    shard.evict();
+    return true;
+  }
+
+  // The capacity is split between the shards. With fewer entries than
+  // shards, strings that hash to a shard without one are not cached.
+  void setCapacity(std::size_t c) {
+    for (std::size_t i = 0; i < SHARDS; i++) {
+      auto &shard = shards[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.capacity = c / SHARDS + (i < c % SHARDS);
+      shard.evict();
+    }
+  }
+
+  void clear() {
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.index.clear();
+      shard.entries.clear();
+    }
+  }
+
+  Stats stats() const {
+    Stats s;
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      s.hits += shard.stats.hits;
+      s.misses += shard.stats.misses;
+      s.evictions += shard.stats.evictions;
+      s.size += shard.entries.size();
+      s.capacity += shard.capacity;
+    }
+    return s;
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    std::string output;
+  };
+
+  struct Shard {
+    std::size_t capacity = 0;
+    std::list<Entry> entries;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+    std::array<std::size_t, 1024 / SHARDS> admitted{};
+    Stats stats;
+    mutable std::mutex mutex;
+
+    void evict() {
+      while (entries.size() > capacity) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+        stats.evictions++;
+      }
+    }
+  };
+
+  std::array<Shard, SHARDS> shards;
+};
+
+// Colors JSON in one pass. Keys are bold, strings green, numbers blue,
+// brackets bold yellow and separators gray. Style changes are written as
+// minimal SGR transitions, so runs of the same token class share one
+// escape sequence. Every line ends unstyled so printers can split the
+// output and add gutters.
+//
+// The tokenizer keeps its state between feed() calls, so a document can
+// arrive in chunks of any size. Keys are told apart from string values by
+// the enclosing container. Lines outside of any container start with a
+// key, which suits fragments of an object.
+class JsonHighlighter {
+public:
+  JsonHighlighter(ColorMode mode = ColorMode::TRUECOLOR) : mode(mode) {}
+
+  template <typename Out> void feed(std::string_view chunk, Out &out) {
+    auto p = chunk.data();
+    auto end = p + chunk.size();
+    while (p < end) {
+      auto start = p;
+      if (inString) {
+        p = stringEnd(p, end);
+        emit(key ? KEY : STRING, start, p, out);
+        if (p < end && *p == '"') {
+          inString = false;
+          expectKey = false;
+          emit(key ? KEY : PLAIN, p, p + 1, out);
+          p++;
+        }
+        continue;
+      }
+      if (inNumber && isNumberChar(*p)) {
+        while (++p < end && isNumberChar(*p))
+          ;
+        emit(NUMBER, start, p, out);
+        continue;
+      }
+      inNumber = false;
+      switch (token(*p)) {
+      case Token::SPACE:
+        while (++p < end && token(*p) == Token::SPACE)
+          ;
+        out.append(start, p);
+        break;
+      case Token::NEWLINE:
+        if (objects.empty())
+          expectKey = true;
+        emit(PLAIN, start, ++p, out);
+        break;
+      case Token::QUOTE:
+        inString = true;
+        escaped = false;
+        key = expectKey;
+        emit(key ? KEY : PLAIN, start, ++p, out);
+        break;
+      case Token::NUMBER:
+        inNumber = true;
+        break;
+      case Token::SEPARATOR:
+        expectKey = *p == ',' && (objects.empty() || objects.back());
+        emit(SEPARATOR, start, ++p, out);
+        break;
+      case Token::BRACKET:
+        if (*p == '{' || *p == '[') {
+          objects.push_back(*p == '{');
+          expectKey = *p == '{';
+        } else {
+          if (!objects.empty())
+            objects.pop_back();
+          expectKey = false;
+        }
+        emit(BRACKET, start, ++p, out);
+        break;
+      case Token::TEXT:
+        while (++p < end && token(*p) == Token::TEXT)
+          ;
+        emit(PLAIN, start, p, out);
+        break;
+      }
+    }
+  }
+
+  // Leaves the output unstyled. The tokenizer is ready for a new document.
+  template <typename Out> void finish(Out &out) {
+    emit(PLAIN, nullptr, nullptr, out);
+    *this = JsonHighlighter(mode);
+  }
+
+  static std::string highlight(std::string_view text,
+                               ColorMode mode = ColorMode::TRUECOLOR) {
+    std::string out;
+    out.reserve(text.size() + text.size() / 2);
+    JsonHighlighter highlighter(mode);
+    highlighter.feed(text, out);
+    highlighter.finish(out);
+    return out;
+  }
+
+private:
+  enum Style { PLAIN, KEY, STRING, NUMBER, SEPARATOR, BRACKET, STYLES };
+  using Transitions = std::array<std::array<std::string, STYLES>, STYLES>;
+
+  enum class Token : uint8_t {
+    TEXT,
+    SPACE,
+    NEWLINE,
+    QUOTE,
+    SEPARATOR,
+    BRACKET,
+    NUMBER
+  };
+
+  ColorMode mode;
+  Style emitted = PLAIN;
+  bool inString = false;
+  bool escaped = false;
+  bool key = false;
+  bool inNumber = false;
+  bool expectKey = true;
+  // Open containers, true for objects.
+  std::vector<bool> objects;
+
+  template <typename Out>
+  void emit(Style to, const char *begin, const char *end, Out &out) {
+    if (to != emitted) {
+      auto &escape = transitions()[static_cast<int>(mode)][emitted][to];
+      out.append(escape.data(), escape.data() + escape.size());
+      emitted = to;
+    }
+    out.append(begin, end);
+  }
+
+  // SGR sequences between every pair of styles in each color mode, built
+  // once.
+  static const std::array<Transitions, 4> &transitions() {
+    static const std::array<Transitions, 4> tables = [] {
+      std::array<Attributes, STYLES> styles{};
+      styles[KEY] |= fmt::emphasis::bold;
+      styles[STRING] |= fmt::fg(fmt::terminal_color::green);
+      styles[NUMBER] |= fmt::fg(fmt::terminal_color::blue);
+      styles[SEPARATOR] |= fmt::fg(fmt::color::gray);
+      styles[BRACKET] |=
+          fmt::emphasis::bold | fmt::fg(fmt::terminal_color::yellow);
+      std::array<Transitions, 4> tables;
+      for (int mode = 0; mode < 4; mode++) {
+        for (int from = 0; from < STYLES; from++) {
+          for (int to = 0; to < STYLES; to++)
+            Ansi::writeTransition(styles[from], styles[to],
+                                  tables[mode][from][to],
+                                  static_cast<ColorMode>(mode));
+        }
+      }
+      return tables;
+    }();
+    return tables;
+  }
+
+  static constexpr std::array<Token, 256> TOKENS = [] {
+    std::array<Token, 256> t{};
+    for (auto c : {' ', '\t', '\r'})
+      t[c] = Token::SPACE;
+    t['\n'] = Token::NEWLINE;
+    for (auto c : {',', ':'})
+      t[c] = Token::SEPARATOR;
+    for (auto c : {'{', '}', '[', ']'})
+      t[c] = Token::BRACKET;
+    for (auto c = '0'; c <= '9'; c++)
+      t[c] = Token::NUMBER;
+    t['-'] = Token::NUMBER;
+    t['"'] = Token::QUOTE;
+    return t;
+  }();
+
+  static constexpr Token token(char c) {
+    return TOKENS[static_cast<unsigned char>(c)];
+  }
+
+  static constexpr bool isNumberChar(char c) {
+    return (c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' ||
+           c == '+' || c == '-';
+  }
+
+  // Moves through string contents up to the closing quote or `end`. A raw
+  // newline ends the string so that lines stay independent.
+  const char *stringEnd(const char *p, const char *end) {
+    while (p < end) {
+      if (escaped) {
+        escaped = false;
+        p++;
+        continue;
+      }
+      p = Simd::find(p, end, '"', '\\', '\n');
+      if (p == end || *p == '"')
+        return p;
+      if (*p == '\n') {
+        inString = false;
+        return p;
+      }
+      escaped = true;
+      p++;
+    }
+    return p;
+  }
+};
+
+// Feeds JSON to a JsonHighlighter in chunks and passes the highlighted
+// output to a sink after every chunk. Memory use is bounded by the chunk
+// size, not by the document.
+class JsonStream {
+public:
+  using Sink = std::function<void(std::string_view)>;
+  static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+  // `done` runs after finish() has passed on the last of the output.
+  JsonStream(Sink sink, ColorMode mode = ColorMode::TRUECOLOR,
+             std::function<void()> done = {})
+      : sink(std::move(sink)), done(std::move(done)), highlighter(mode) {}
+
+  void feed(std::string_view chunk) {
+    highlighter.feed(chunk, buffer);
+    flush();
+  }
+
+  void feed(std::istream &in) {
+    std::string chunk(CHUNK_SIZE, '\0');
+    while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0)
+      feed(std::string_view(chunk.data(), in.gcount()));
+  }
+
+  // Reads `fd` until end of file. Returns false on a read error.
+  bool feed(int fd) {
+    std::string chunk(CHUNK_SIZE, '\0');
+    while (true) {
+      auto n = ::read(fd, chunk.data(), chunk.size());
+      if (n == 0)
+        return true;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      feed(std::string_view(chunk.data(), n));
+    }
+  }
+
+  void finish() {
+    highlighter.finish(buffer);
+    flush();
+    if (done)
+      done();
+  }
+
+private:
+  Sink sink;
+  std::function<void()> done;
+  JsonHighlighter highlighter;
+  fmt::memory_buffer buffer;
+
+  void flush() {
+    if (buffer.size() == 0)
+      return;
+    sink(std::string_view(buffer.data(), buffer.size()));
+    buffer.clear();
+  }
+};
+
+// Destination of rendered output. Text arrives colored; a sink with
+// colorMode NONE strips the escape sequences on the way in and ANSI16 or
+// ANSI256 converts their colors, so a line is rendered once no matter how
+// many sinks receive it.
+class Sink {
+public:
+  ColorMode colorMode;
+
+  Sink(ColorMode mode = ColorMode::TRUECOLOR) : colorMode(mode) {}
+  virtual ~Sink() = default;
+
+  void send(std::string_view text) {
+    if (colorMode == ColorMode::TRUECOLOR) {
+      write(text);
+      return;
+    }
+    thread_local std::string converted;
+    converted.clear();
+    Ansi::downgrade(text, colorMode, converted);
+    write(converted);
+  }
+
+  // Passes `text` on as it is, whatever colorMode says; for binary data.
+  void sendRaw(std::string_view text) { writeRaw(text); }
+
+  virtual bool flush() { return true; }
+
+  // True if send() is cheap and may be called by several threads at once.
+  // OutputBuffer then passes text straight through instead of buffering it
+  // under its lock.
+  virtual bool concurrent() const { return false; }
+
+protected:
+  virtual void write(std::string_view text) = 0;
+  // Sinks that hand text on to other sinks keep it raw there too.
+  virtual void writeRaw(std::string_view text) { write(text); }
+};
+
+// Writes to a file descriptor it does not own. Pending stdio output is
+// flushed before writing to stdout so that fmt::print and std::cout keep
+// their order. Each send() is one write(2), so threads may share it.
+class FdSink : public Sink {
+public:
+  FdSink(int fd, ColorMode mode = ColorMode::TRUECOLOR) : Sink(mode), fd(fd) {}
+
+  bool flush() override { return ok; }
+
+protected:
+  int fd;
+  std::atomic<bool> ok = true;
+
+  void write(std::string_view text) override {
+    if (fd == STDOUT_FILENO)
+      std::fflush(stdout);
+    auto p = text.data();
+    auto end = p + text.size();
+    while (p < end) {
+      auto n = ::write(fd, p, end - p);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        ok = false;
+        return;
+      }
+      p += n;
+    }
+  }
+};
+
+// Appends to a file, without colors unless asked for.
+class FileSink : public FdSink {
+public:
+  FileSink(const std::string &path, ColorMode mode = ColorMode::NONE)
+      : FdSink(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                      0644),
+               mode) {
+    ok = fd >= 0;
+  }
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+  ~FileSink() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  bool isOpen() const { return fd >= 0; }
+
+protected:
+  void write(std::string_view text) override {
+    if (fd >= 0)
+      FdSink::write(text);
+  }
+};
+
+// Keeps everything in memory, for tests and for embedding the output.
+class MemorySink : public Sink {
+public:
+  using Sink::Sink;
+
+  std::string_view str() const { return text; }
+  void clear() { text.clear(); }
+
+protected:
+  void write(std::string_view t) override { text.append(t); }
+
+private:
+  std::string text;
+};
+
+// Passes text on to several sinks, each in its own color mode.
+class FanoutSink : public Sink {
+public:
+  FanoutSink(std::initializer_list<Sink *> sinks = {}) : sinks(sinks) {}
+
+  void add(Sink &sink) { sinks.push_back(&sink); }
+
+  bool flush() override {
+    auto ok = true;
+    for (auto sink : sinks)
+      ok = sink->flush() && ok;
+    return ok;
+  }
+
+protected:
+  void write(std::string_view text) override {
+    for (auto sink : sinks)
+      sink->send(text);
+  }
+
+  void writeRaw(std::string_view text) override {
+    for (auto sink : sinks)
+      sink->sendRaw(text);
+  }
+
+private:
+  std::vector<Sink *> sinks;
+};
+
+// Hands text to a background thread that writes it to `target` in
+// batches, so producers never block on the target. Each send() copies the
+// text into a slot of a bounded lock-free multi-producer queue (Vyukov's
+// design) whose strings keep their capacity between uses. What happens when
+// the queue is full is up to the overflow policy.
+class AsyncSink : public Sink {
+public:
+  enum class Overflow {
+    BLOCK, // wait for a free slot
+    DROP,  // discard the text and count it in dropped()
+    GROW   // spill into an unbounded list until the writer catches up
+  };
+
+  static constexpr std::size_t SLOT_SIZE = 256;
+
+  AsyncSink(Sink &target, std::size_t capacity = 4096,
+            Overflow overflow = Overflow::BLOCK)
+      : overflow(overflow), target(target), cells(roundUp(capacity)),
+        mask(cells.size() - 1) {
+    for (std::size_t i = 0; i < cells.size(); i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+      cells[i].text.reserve(SLOT_SIZE);
+    }
+    writer = std::thread([this] { run(); });
+  }
+  AsyncSink(const AsyncSink &) = delete;
+  AsyncSink &operator=(const AsyncSink &) = delete;
+
+  ~AsyncSink() {
+    drain();
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+
+  // Does not wait for the writer; see drain().
+  bool flush() override { return true; }
+
+  bool concurrent() const override { return true; }
+
+  // Waits until everything sent so far has reached the target.
+  void drain() {
+    auto queued = enqueuePos.load(std::memory_order_acquire);
+    std::size_t spilled;
+    {
+      std::lock_guard lock(spillMutex);
+      spilled = spillQueued;
+    }
+    std::unique_lock lock(mutex);
+    wake.notify_one();
+    drained.wait(lock, [&] {
+      return written.load(std::memory_order_acquire) >= queued &&
+             spillWritten.load(std::memory_order_acquire) >= spilled;
+    });
+  }
+
+  std::size_t dropped() const {
+    return droppedCount.load(std::memory_order_relaxed);
+  }
+
+  const Overflow overflow;
+
+protected:
+  void write(std::string_view text) override { push(text, false); }
+  void writeRaw(std::string_view text) override { push(text, true); }
+
+private:
+  // Raw text reaches the target with sendRaw().
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    std::string text;
+    bool raw = false;
+  };
+  struct Spilled {
+    std::string text;
+    bool raw;
+  };
+
+  Sink &target;
+  std::vector<Cell> cells;
+  const std::size_t mask;
+  alignas(64) std::atomic<std::size_t> enqueuePos{0};
+  alignas(64) std::size_t dequeuePos = 0;
+  // Queue positions and spilled texts that have reached the target.
+  std::atomic<std::size_t> written{0};
+  std::atomic<std::size_t> spillWritten{0};
+  std::atomic<std::size_t> droppedCount{0};
+
+  std::atomic<bool> spilling{false};
+  std::mutex spillMutex;
+  std::vector<Spilled> spill;
+  std::size_t spillQueued = 0;
+
+  std::atomic<bool> sleeping{false};
+  bool stopping = false;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable drained;
+  std::thread writer;
+
+  static std::size_t roundUp(std::size_t n) {
+    std::size_t size = 2;
+    while (size < n)
+      size *= 2;
+    return size;
+  }
+
+  void push(std::string_view text, bool raw) {
+    if (spilling.load(std::memory_order_acquire) || !tryPush(text, raw)) {
+      switch (overflow) {
+      case Overflow::BLOCK:
+        while (!tryPush(text, raw)) {
+          notify();
+          std::this_thread::yield();
+        }
+        break;
+      case Overflow::DROP:
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+      case Overflow::GROW: {
+        std::lock_guard lock(spillMutex);
+        spill.push_back(Spilled{std::string(text), raw});
+        spillQueued++;
+        spilling.store(true, std::memory_order_release);
+        break;
+      }
+      }
+    }
+    notify();
+  }
+
+  bool tryPush(std::string_view text, bool raw) {
+    auto pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      auto seq = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->text.assign(text);
+    cell->raw = raw;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool ready() const {
+    return cells[dequeuePos & mask].sequence.load(std::memory_order_acquire) ==
+               dequeuePos + 1 ||
+           spilling.load(std::memory_order_acquire);
+  }
+
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard lock(mutex);
+      wake.notify_one();
+    }
+  }
+
+  // Passes queued text to `take(text, raw)`, the queue first and then
+  // anything spilled while it was full, which keeps each producer's order.
+  // Returns the number of spilled texts taken.
+  template <typename F> std::size_t pop(F take) {
+    while (true) {
+      auto &cell = cells[dequeuePos & mask];
+      if (cell.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+        break;
+      take(cell.text, cell.raw);
+      cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+      dequeuePos++;
+    }
+    if (!spilling.load(std::memory_order_acquire))
+      return 0;
+    std::lock_guard lock(spillMutex);
+    for (auto &spilled : spill)
+      take(spilled.text, spilled.raw);
+    auto n = spill.size();
+    spill.clear();
+    spilling.store(false, std::memory_order_release);
+    return n;
+  }
+
+  void run() {
+    // Consecutive texts of the same kind go out as one batch.
+    fmt::memory_buffer batch;
+    auto batchRaw = false;
+    auto send = [&] {
+      std::string_view text(batch.data(), batch.size());
+      if (batchRaw)
+        target.sendRaw(text);
+      else
+        target.send(text);
+      batch.clear();
+    };
+    auto take = [&](std::string_view text, bool raw) {
+      if (raw != batchRaw && batch.size() > 0)
+        send();
+      batchRaw = raw;
+      batch.append(text.data(), text.data() + text.size());
+    };
+    while (true) {
+      auto spilled = pop(take);
+      if (spilled > 0 ||
+          dequeuePos != written.load(std::memory_order_relaxed)) {
+        send();
+        target.flush();
+        written.store(dequeuePos, std::memory_order_release);
+        spillWritten.fetch_add(spilled, std::memory_order_release);
+        std::lock_guard lock(mutex);
+        drained.notify_all();
+        continue;
+      }
+      std::unique_lock lock(mutex);
+      if (stopping)
+        return;
+      sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!ready())
+        wake.wait_for(lock, std::chrono::milliseconds(10));
+      sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+};
+
+// Output collected in a fmt::memory_buffer and handed to a sink in one
+// piece per flush, which for FdSink is a single write(2). A concurrent()
+// sink such as AsyncSink buffers on its own and gets every piece at once,
+// so threads sharing a printer don't meet at the buffer's lock.
+class OutputBuffer {
+public:
+  enum class Flush {
+    LINE,     // after every line
+    FULL,     // when the buffer reaches its capacity
+    EXPLICIT, // only on flush()
+    INTERVAL  // `interval` after the last flush, by a timer thread if no
+              // line ends by then
+  };
+
+  static constexpr std::size_t CAPACITY = 64 * 1024;
+
+  Flush policy;
+  std::chrono::milliseconds interval{100};
+  // Hands text to the sink with sendRaw(), unconverted; for binary data.
+  bool raw = false;
+
+  OutputBuffer(Sink &sink, Flush policy = Flush::LINE)
+      : policy(policy), sink(&sink), direct(sink.concurrent()),
+        lastFlush(std::chrono::steady_clock::now()) {}
+  OutputBuffer(int fd = STDOUT_FILENO, Flush policy = Flush::LINE)
+      : OutputBuffer(std::make_unique<FdSink>(fd), policy) {}
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  ~OutputBuffer() {
+    if (timer.joinable()) {
+      {
+        std::lock_guard lock(mutex);
+        closing = true;
+      }
+      due.notify_one();
+      timer.join();
+    }
+    flush();
+  }
+
+  // Shared buffer for stdout, flushed at exit.
+  static OutputBuffer &standard() {
+    static OutputBuffer out;
+    return out;
+  }
+
+  void write(std::string_view text) {
+    if (direct) {
+      deliver(text);
+      return;
+    }
+    std::lock_guard lock(mutex);
+    buffer.append(text.data(), text.data() + text.size());
+    written();
+  }
+
+  template <typename... Args>
+  void print(fmt::format_string<Args...> fmt_string, Args &&...args) {
+    if (direct) {
+      deliver(fmt::format(fmt_string, std::forward<Args>(args)...));
+      return;
+    }
+    std::lock_guard lock(mutex);
+    fmt::format_to(std::back_inserter(buffer), fmt_string,
+                   std::forward<Args>(args)...);
+    written();
+  }
+
+  // Appends complete lines, each ending in '\n', or a whole screen update
+  // in one step: text written this way by different threads never
+  // interleaves.
+  void writeLines(std::string_view lines) {
+    if (direct) {
+      deliver(lines);
+      return;
+    }
+    std::lock_guard lock(mutex);
+    buffer.append(lines.data(), lines.data() + lines.size());
+    lineEnded();
+  }
+
+  void endLine() {
+    if (direct) {
+      deliver("\n");
+      return;
+    }
+    std::lock_guard lock(mutex);
+    buffer.push_back('\n');
+    lineEnded();
+  }
+
+  // Returns false if the sink failed to take the data, which is dropped.
+  bool flush() {
+    std::lock_guard lock(mutex);
+    return flushLocked();
+  }
+
+  std::size_t size() const {
+    std::lock_guard lock(mutex);
+    return buffer.size();
+  }
+
+private:
+  Sink *sink;
+  // The sink is concurrent(): nothing is buffered and the mutex not taken.
+  const bool direct;
+  mutable std::mutex mutex;
+  std::unique_ptr<Sink> owned;
+  fmt::memory_buffer buffer;
+  std::chrono::steady_clock::time_point lastFlush;
+  // Flushes INTERVAL buffers that no line end flushed in time. Started by
+  // the first write in that mode; waits without a deadline while the
+  // buffer is empty.
+  std::thread timer;
+  std::condition_variable due;
+  bool timerIdle = false;
+  bool closing = false;
+
+  OutputBuffer(std::unique_ptr<Sink> sink, Flush policy)
+      : OutputBuffer(*sink, policy) {
+    owned = std::move(sink);
+  }
+
+  // After text that does not end a line.
+  void written() {
+    if (buffer.size() >= CAPACITY && policy != Flush::EXPLICIT)
+      flushLocked();
+    else if (policy == Flush::INTERVAL)
+      arm();
+  }
+
+  void lineEnded() {
+    switch (policy) {
+    case Flush::LINE:
+      flushLocked();
+      break;
+    case Flush::INTERVAL:
+      if (std::chrono::steady_clock::now() - lastFlush >= interval)
+        flushLocked();
+      else
+        arm();
+      break;
+    case Flush::FULL:
+    case Flush::EXPLICIT:
+      if (buffer.size() >= CAPACITY && policy == Flush::FULL)
+        flushLocked();
+      break;
+    }
+  }
+
+  void deliver(std::string_view text) {
+    if (raw)
+      sink->sendRaw(text);
+    else
+      sink->send(text);
+  }
+
+  void arm() {
+    if (!timer.joinable()) {
+      timer = std::thread([this] { runTimer(); });
+    } else if (timerIdle) {
+      timerIdle = false;
+      due.notify_one();
+    }
+  }
+
+  void runTimer() {
+    std::unique_lock lock(mutex);
+    while (!closing) {
+      if (buffer.size() == 0 || policy != Flush::INTERVAL) {
+        timerIdle = true;
+        due.wait(lock);
+        continue;
+      }
+      auto deadline = lastFlush + interval;
+      if (std::chrono::steady_clock::now() >= deadline)
+        flushLocked();
+      else
+        due.wait_until(lock, deadline);
+    }
+  }
+
+  bool flushLocked() {
+    lastFlush = std::chrono::steady_clock::now();
+    if (buffer.size() > 0) {
+      deliver(std::string_view(buffer.data(), buffer.size()));
+      buffer.clear();
+    }
+    return sink->flush();
+  }
+};
 
 class utils {
 public:
-  static int realLength(std::string s) {
-    return std::wstring_convert<std::codecvt_utf8<wchar_t>>()
-        .from_bytes(utils::stripEsc(s))
-        .size();
+  static int realLength(std::string_view s) {
+    return static_cast<int>(DisplayWidth::of(s));
+  }
+
+  // Pads `text` with spaces to `width` terminal columns.
+  static std::string pad(std::string_view text, int width, Align align) {
+    auto fill = std::max(0, width - realLength(text));
+    auto left = align == Align::RIGHT ? fill : align == Align::MIDDLE ? fill / 2 : 0;
+    std::string out;
+    out.reserve(text.size() + fill);
+    out.append(left, ' ');
+    out.append(text);
+    out.append(fill - left, ' ');
+    return out;
+  }
+  // Allocates once, then doubles the copied prefix until the string is full.
+  static std::string repeat(std::string_view s, int n) {
+    if (n <= 0 || s.empty())
+      return {};
+    std::string out(s.size() * n, '\0');
+    std::memcpy(out.data(), s.data(), s.size());
+    for (auto filled = s.size(); filled < out.size();) {
+      auto count = std::min(filled, out.size() - filled);
+      std::memcpy(out.data() + filled, out.data(), count);
+      filled += count;
+    }
+    return out;
   }
-  static std::string repeat(std::string s, int n) {
-    std::ostringstream os;
-    for (int i = 0; i < n; i++)
-      os << s;
-    return os.str();
+  static void br() { OutputBuffer::standard().endLine(); }
+  // Cursor control goes out at once, after what is already buffered, so it
+  // is not held back behind output written to the terminal another way.
+  static void control(std::string_view esc) {
+    auto &out = OutputBuffer::standard();
+    out.write(esc);
+    out.flush();
   }
-  static void br() { fmt::print(fmt::runtime("\n")); }
-  static void up(int n = 1) { fmt::print(fmt::runtime("\e[{}A"), n); }
-  static void clearLine() { fmt::print(fmt::runtime("\e[2K")); }
+  static void up(int n = 1) { control(fmt::format("\e[{}A", n)); }
+  static void clearLine() { control("\e[2K"); }
 
-  static void saveCursor() { fmt::print(fmt::runtime("\e7")); }
-  static void restoreCursor() { fmt::print(fmt::runtime("\e8")); }
+  static void saveCursor() { control("\e7"); }
+  static void restoreCursor() { control("\e8"); }
 
   static void h1(std::string text) {
-    fmt::print(fmt::runtime("\n{:━^80}\n\n"), utils::bold(" {} ", text));
+    auto fill = std::max(0, 78 - realLength(text));
+    OutputBuffer::standard().print("\n{}{}{}\n", bar(fill / 2),
+                                   utils::bold(" {} ", text),
+                                   bar(fill - fill / 2));
+    OutputBuffer::standard().endLine();
   }
 
   static void h2(std::string text) {
-    fmt::print(fmt::runtime("\n━━{:━<78}\n\n"), utils::bold(" {} ", text));
+    OutputBuffer::standard().print("\n{}{}{}\n", bar(2),
+                                   utils::bold(" {} ", text),
+                                   bar(std::max(0, 76 - realLength(text))));
+    OutputBuffer::standard().endLine();
   }
 
   static void h3(std::string text) {
-    fmt::print(fmt::runtime("──{:─<78}\n"), utils::bold(" {} ", text));
+    OutputBuffer::standard().print("{}{}{}", bar(2, true),
+                                   utils::bold(" {} ", text),
+                                   bar(std::max(0, 76 - realLength(text)), true));
+    OutputBuffer::standard().endLine();
   }
 
+  // Rules are redrawn often with the same few parameters, so rendered rules
+  // are cached by (length, color, thin, end_line) and the color mode. The
+  // cache is per thread and needs no lock.
   static std::string
   rule(int l = 80,
        fmt::detail::color_type rule_color = fmt::terminal_color::white,
        bool end_line = true, bool thin = false) {
-    return fmt::format(
-        fmt::runtime(utils::color(rule_color, utils::bold(thin ? "{:─^{}}{}" : "{:━^{}}{}",
-                                             "", l, end_line ? "\n" : ""))));
+    thread_local std::unordered_map<uint64_t, std::string> cache;
+    auto c = Color::from(rule_color);
+    auto key = static_cast<uint64_t>(std::max(0, l)) << 32 |
+               static_cast<uint64_t>(Terminal::colorMode()) << 28 |
+               static_cast<uint64_t>(c.kind) << 26 | (c.value & 0xffffff) << 2 |
+               thin << 1 | end_line;
+    auto it = cache.find(key);
+    if (it != cache.end())
+      return it->second;
+    if (cache.size() >= 256)
+      cache.clear();
+    auto text = bar(l, thin);
+    if (end_line)
+      text += '\n';
+    return cache[key] = utils::color(rule_color, utils::bold(text));
+  }
+
+  // Unstyled run of `n` rule characters, as used by rule() and headers.
+  static std::string bar(int n, bool thin = false) {
+    return repeat(thin ? "─" : "━", n);
   }
 
   static std::string
@@ -72,29 +2698,12 @@ public:
     return rule(l, l_color, false) + rule(r, r_color, end_line);
   }
 
-  static std::string highlight(std::string text) {
-
-    std::regex b_re(R"([\{\}]+)");
-    std::regex p_re("([,:]+)");
-    std::regex q_re(R"(\"([^\":]+)\")");
-    std::regex k_re("(.*):");
-    std::regex n_re(": ([0-9.]+)");
-    auto p_sub = utils::gray("$0");
-    auto q = utils::gray("\"");
-    auto q_sub = "\"" + utils::green("$1") + "\"";
-    auto k_sub = utils::bold("$1") + ":";
-    auto n_sub = ": " + utils::blue("$1");
-    auto b_sub = utils::bold(utils::yellow("$0"));
-    text = std::regex_replace(text, n_re, n_sub);
-    text = std::regex_replace(text, b_re, b_sub);
-    text = std::regex_replace(text, q_re, q_sub);
-    text = std::regex_replace(text, k_re, k_sub);
-    text = std::regex_replace(text, p_re, p_sub);
-    return std::string(text);
-  }
-
-  static std::string parse(std::string_view text) {
-    parser parser(R"(
+  static std::string highlight(std::string_view text,
+                               ColorMode mode = Terminal::colorMode()) {
+    return JsonHighlighter::highlight(text, mode);
+  }
+
+  static constexpr const char *markupGrammar = R"(
         ROOT      <- CONTENT
         CONTENT   <- (ELEMENT / TEXT)*
         ELEMENT   <- $(STAG CONTENT ETAG)
@@ -105,12 +2714,150 @@ public:
         TEXT      <- TEXT_DATA
         TEXT_DATA <- ![<] .
         ~_        <- [ \t\r\n]*
-   )");
-    parser.enable_ast();
-    parser.log = [](std::size_t line, std::size_t col, const std::string &msg) {
-      std::cerr << "Parse error at " << line << ":" << col << " => " << msg
-                << "\n";
-    };
+   )";
+
+  // Grammar is compiled once on first use. parser::parse is const and keeps
+  // no per-call state, so the instance is shared between threads.
+  static const parser &markupParser() {
+    static const parser instance = [] {
+      parser p(markupGrammar);
+      p.enable_ast();
+      p.log = [](std::size_t line, std::size_t col, const std::string &msg) {
+        std::cerr << "Parse error at " << line << ":" << col << " => " << msg
+                  << "\n";
+      };
+      return p;
+    }();
+    return instance;
+  }
+
+  // One cache per color mode, since each renders differently.
+  static MarkupCache &markupCache(ColorMode mode = ColorMode::TRUECOLOR) {
+    static MarkupCache caches[4];
+    return caches[static_cast<int>(mode)];
+  }
+
+  // Renders markup without going through the cache.
+  template <typename Out>
+  static bool renderMarkup(std::string_view text, Out &out,
+                           ColorMode mode = ColorMode::TRUECOLOR) {
+    auto size = out.size();
+    MarkupRenderer renderer;
+    renderer.colorMode = mode;
+    if (mode == ColorMode::NONE ? !renderer.strip(text, out)
+                                : !renderer.render(text, out)) {
+      renderer.logError(text);
+      out.resize(size);
+      return false;
+    }
+    return true;
+  }
+
+  // Cheap prefilter: text without '<' renders to itself (without escapes
+  // either, when they are being stripped or converted).
+  static bool hasMarkup(std::string_view text,
+                        ColorMode mode = ColorMode::TRUECOLOR) {
+    auto end = text.data() + text.size();
+    if (mode != ColorMode::TRUECOLOR)
+      return Simd::find(text.data(), end, '<', '\x1b') != end;
+    return Simd::find(text.data(), end, '<') != end;
+  }
+
+  // Stripping is a single copy already, so it bypasses the cache.
+  static std::string parse(std::string_view text,
+                           ColorMode mode = Terminal::colorMode()) {
+    if (!hasMarkup(text, mode))
+      return std::string(text);
+    std::string content;
+    if (mode == ColorMode::NONE) {
+      renderMarkup(text, content, mode);
+      return content;
+    }
+    markupCache(mode).render(text, content, [mode](auto text, auto &out) {
+      return renderMarkup(text, out, mode);
+    });
+    return content;
+  }
+
+  // Registers an application tag, e.g.
+  // registerTag("warn", fmt::fg(fmt::color::orange) | fmt::emphasis::bold).
+  // Built-in tags can't be replaced.
+  static bool registerTag(std::string_view name, const fmt::text_style &style) {
+    if (MarkupRenderer::isBuiltinTag(name) ||
+        !TagRegistry::instance().add(name, style))
+      return false;
+    for (auto mode : {ColorMode::ANSI16, ColorMode::ANSI256,
+                      ColorMode::TRUECOLOR}) {
+      markupCache(mode).clear();
+      templateCache(mode).clear();
+    }
+    return true;
+  }
+
+  static MarkupCache &templateCache(ColorMode mode = ColorMode::TRUECOLOR) {
+    static MarkupCache caches[4];
+    return caches[static_cast<int>(mode)];
+  }
+
+  // Compiles the markup of an fmt format string, leaving its replacement
+  // fields in place.
+  template <typename Out>
+  static bool renderTemplate(std::string_view text, Out &out,
+                             ColorMode mode = ColorMode::TRUECOLOR) {
+    auto size = out.size();
+    MarkupRenderer renderer;
+    renderer.formatString = true;
+    renderer.colorMode = mode;
+    if (mode == ColorMode::NONE ? !renderer.strip(text, out)
+                                : !renderer.render(text, out)) {
+      renderer.logError(text);
+      out.resize(size);
+      return false;
+    }
+    return true;
+  }
+
+  // Markup-first formatting: the markup of `fmt_string` is compiled once
+  // (and cached), then the arguments are substituted into the result. The
+  // arguments are never scanned for tags, so `<` and `{` in them are safe.
+  template <typename S, typename... Args>
+  static std::string format(ColorMode mode, const S &fmt_string,
+                            const Args &...args) {
+    return vformat(mode, fmt_string, fmt::make_format_args(args...));
+  }
+
+  // format() with type-erased arguments. With ColorMode::NONE escapes that
+  // came in with the arguments are stripped too.
+  static std::string vformat(ColorMode mode, std::string_view fmt_string,
+                             fmt::format_args args) {
+    std::string text;
+    if (!hasMarkup(fmt_string, mode)) {
+      text = fmt::vformat(fmt_string, args);
+    } else {
+      std::string compiled;
+      if (mode == ColorMode::NONE) {
+        renderTemplate(fmt_string, compiled, mode);
+      } else {
+        templateCache(mode).render(fmt_string, compiled,
+                                   [mode](auto text, auto &out) {
+                                     return renderTemplate(text, out, mode);
+                                   });
+      }
+      text = fmt::vformat(compiled, args);
+    }
+    if (mode == ColorMode::NONE)
+      Ansi::strip(text);
+    return text;
+  }
+
+  template <typename S, typename... Args>
+  static std::string format(const S &fmt_string, const Args &...args) {
+    return format(Terminal::colorMode(), fmt_string, args...);
+  }
+
+  // Reference implementation on top of peglib, kept for conformance checks.
+  static std::string parsePeg(std::string_view text) {
+    auto &parser = markupParser();
 
     std::shared_ptr<Ast> ast;
     std::string content = "";
@@ -191,22 +2938,43 @@ public:
     return content;
   }
 
+  // Style helpers write the escapes of the detected terminal mode (see
+  // Terminal::colorMode()).
   template <typename S, typename... Args>
   static std::string color(fmt::detail::color_type c, const S &fmt_string,
                            const Args &...args) {
-    return fmt::format(fmt::fg(c), fmt::runtime(fmt_string),
-                       std::forward<const Args &>(args)...);
+    return style(fmt::fg(c), fmt_string, std::forward<const Args &>(args)...);
   }
   template <typename S, typename... Args>
   static std::string bg(fmt::detail::color_type c, const S &fmt_string,
                         const Args &...args) {
-    return fmt::format(fmt::bg(c), fmt::runtime(fmt_string),
-                       std::forward<const Args &>(args)...);
+    return style(fmt::bg(c), fmt_string, std::forward<const Args &>(args)...);
   }
   template <typename S, typename... Args>
   static std::string style(fmt::text_style c, const S &fmt_string,
                            const Args &...args) {
-    return fmt::format(c, fmt::runtime(fmt_string), std::forward<const Args &>(args)...);
+    auto mode = Terminal::colorMode();
+    if (mode == ColorMode::TRUECOLOR)
+      return fmt::format(c, fmt::runtime(fmt_string), std::forward<const Args &>(args)...);
+    return styled(mode, c,
+                  fmt::format(fmt::runtime(fmt_string), std::forward<const Args &>(args)...));
+  }
+
+  // `text` in `style`, with the escapes `mode` supports.
+  static std::string styled(ColorMode mode, const fmt::text_style &style,
+                            std::string_view text) {
+    if (mode == ColorMode::TRUECOLOR)
+      return fmt::format(style, "{}", text);
+    if (mode == ColorMode::NONE)
+      return std::string(text);
+    Attributes attrs;
+    attrs |= style;
+    std::string out;
+    Ansi::writeTransition(Attributes{}, attrs, out, mode);
+    out += text;
+    if (!attrs.empty())
+      out += "\x1b[0m";
+    return out;
   }
 
   template <typename S, typename... Args>
@@ -338,28 +3106,47 @@ public:
     return result;
   }
 
-  static std::vector<std::string> split(std::string strToSplit,
+  static std::vector<std::string> split(std::string_view strToSplit,
                                         char delimeter) {
-    std::stringstream ss(strToSplit);
-    std::string item;
     std::vector<std::string> splittedStrings;
-    while (std::getline(ss, item, delimeter)) {
-      splittedStrings.push_back(item);
-    }
+    for (auto item : Split(strToSplit, delimeter))
+      splittedStrings.emplace_back(item);
     return splittedStrings;
   }
 
-  static std::string stripEsc(std::string str) {
-    // std::regex esc_re("\\033\[[0-9;]+m");
-    std::regex esc_re("\e\[[0-9;]+m");
-    return std::regex_replace(str, esc_re, "");
+  // Lines of `text` without copying; see Split.
+  static Split lines(std::string_view text) { return Split(text, '\n'); }
+
+  // Copies `text` without its escape sequences into a new string.
+  static std::string stripEsc(std::string_view text) {
+    std::string str;
+    str.reserve(text.size());
+    Ansi::strip(text, std::back_inserter(str));
+    return str;
+  }
+
+  // A string passed by value, e.g. what utils::parse returns, is stripped
+  // in place and keeps its buffer.
+  template <typename S>
+    requires std::is_same_v<S, std::string>
+  static std::string stripEsc(S &&text) {
+    Ansi::strip(text);
+    return std::move(text);
+  }
+
+  template <typename OutputIt>
+  static OutputIt stripEsc(std::string_view text, OutputIt out) {
+    return Ansi::strip(text, out);
+  }
+
+  // Length of `text` without escape sequences, in bytes.
+  static std::size_t stripEscLength(std::string_view text) {
+    return Ansi::strippedLength(text);
   }
 
   // static constexpr fmt::detail::color_type NOCOLOR = fmt::detail::color_type{};
 }; // namespace LibLog
 
-enum class Align { LEFT, MIDDLE, RIGHT };
-
 class Gutter {
 public:
   // TODO: style state stack
@@ -369,70 +3156,151 @@ public:
     Align align = Align::MIDDLE;
     fmt::detail::color_type bgColor;
   };
-  std::stack<State> states;
 
   void push(int w) {
-    auto s = states.top();
-    states.push(State{w, s.content, s.align, s.bgColor});
+    pushWith([&](State &s) { s.width = w; });
   }
 
   void push(std::string c) {
-    auto s = states.top();
-    states.push(State{utils::realLength(c), c, s.align, s.bgColor});
+    pushWith([&](State &s) {
+      s.width = utils::realLength(c);
+      s.content = c;
+    });
   }
 
   void push(Align a) {
-    auto s = states.top();
-    states.push(State{s.width, s.content, a, s.bgColor});
+    pushWith([&](State &s) { s.align = a; });
   }
 
   void push(int w, std::string c, Align a) {
-    auto s = states.top();
-    states.push(State{w, c, a, s.bgColor});
+    pushWith([&](State &s) {
+      s.width = w;
+      s.content = c;
+      s.align = a;
+    });
   }
 
   void push(fmt::detail::color_type bg) {
-    auto s = states.top();
-    states.push(State{s.width, s.content, s.align, bg});
+    pushWith([&](State &s) { s.bgColor = bg; });
   }
 
+  void push(State state) {
+    pushWith([&](State &s) { s = state; });
+  }
+
+  // The first state is never popped.
   void pop(int t = 1) {
     for (auto i = 0; i < t; i++) {
-      states.pop();
+      replaceTop([](const NodePtr &top) {
+        return top->parent ? top->parent : top;
+      });
+    }
+  }
+
+  void clear() {
+    replaceTop([](NodePtr top) {
+      while (top->parent)
+        top = top->parent;
+      return top;
+    });
+  }
+
+  // Changes the current state in place instead of pushing a new one.
+  template <typename F> void modify(F f) {
+    replaceTop([&](const NodePtr &top) {
+      auto s = top->state;
+      f(s);
+      return std::make_shared<const Node>(Node{std::move(s), top->parent});
+    });
+  }
+
+  State top() const { return load()->state; }
+
+  // Equal for two gutters that render the same because they share their
+  // top state. Stays unique while a copy holding that state is alive.
+  const void *stateId() const { return enabled ? load().get() : nullptr; }
+
+  std::size_t size() const {
+    std::size_t n = 0;
+    for (auto node = load(); node; node = node->parent)
+      n++;
+    return n;
+  }
+
+  void print(ColorMode mode = ColorMode::TRUECOLOR) {
+    print(OutputBuffer::standard(), mode);
+  }
+
+  void print(OutputBuffer &out, ColorMode mode = ColorMode::TRUECOLOR) {
+    std::string text;
+    render(text, mode);
+    out.write(text);
+  }
+
+  void render(std::string &out, ColorMode mode = ColorMode::TRUECOLOR) const {
+    if (!enabled)
+      return;
+
+    auto node = load();
+    const auto &[width, content, align, bgColor] = node->state;
+    if (width <= 0)
+      return;
+
+    if (mode == ColorMode::NONE) {
+      out += utils::pad(utils::parse(content, mode), width, align);
+      return;
     }
+    auto text = utils::styled(ColorMode::TRUECOLOR, fmt::bg(bgColor),
+                              utils::pad(content, width, align));
+    Ansi::downgrade(text, mode);
+    out += text;
   }
 
-  void clear() { pop(states.size() - 1); }
+  bool enabled = true;
+  Gutter(std::string c = "", int w = 0, Align a = Align::MIDDLE,
+         fmt::detail::color_type bg = fmt::detail::color_type{})
+      : head(std::make_shared<const Node>(
+            Node{State{w == 0 ? utils::realLength(c) : w, c, a, bg}, {}})) {}
+  Gutter(const Gutter &other) : enabled(other.enabled), head(other.load()) {}
+  Gutter &operator=(const Gutter &other) {
+    enabled = other.enabled;
+    auto node = other.load();
+    std::lock_guard lock(mutex);
+    head = std::move(node);
+    return *this;
+  }
 
-  void print() {
-    if (!enabled)
-      return;
+private:
+  // States form a persistent list: a push never changes the nodes below it,
+  // so a copy of a Gutter costs one pointer and can be pushed and popped
+  // without affecting the original, or other threads reading it. The mutex
+  // only guards the head pointer, never rendering; a copy holds it for one
+  // shared_ptr copy.
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+  struct Node {
+    State state;
+    NodePtr parent;
+  };
+  NodePtr head;
+  mutable std::mutex mutex;
 
-    auto content = states.top().content;
-    auto align = states.top().align;
-    auto bgColor = states.top().bgColor;
-    auto width = states.top().width;
-    if (width <= 0)
-      return;
+  NodePtr load() const {
+    std::lock_guard lock(mutex);
+    return head;
+  }
 
-    auto f = content.size() - utils::stripEsc(content).size();
-    switch (align) {
-    case Align::LEFT:
-      fmt::print(fmt::runtime(utils::bg(bgColor, fmt::format(fmt::runtime("{:<{}}"), content, width + f))));
-      break;
-    case Align::MIDDLE:
-      fmt::print(fmt::runtime(utils::bg(bgColor, fmt::format(fmt::runtime("{:^{}}"), content, width + f))));
-      break;
-    case Align::RIGHT:
-      fmt::print(fmt::runtime(utils::bg(bgColor, fmt::format(fmt::runtime("{:>{}}"), content, width + f))));
-      break;
-    } // namespace LibPrint
+  template <typename F> void replaceTop(F next) {
+    std::lock_guard lock(mutex);
+    head = next(head);
   }
 
-  bool enabled = true;
-  Gutter(std::string c = "", int w = 0, Align a = Align::MIDDLE,
-         fmt::detail::color_type bg = fmt::detail::color_type{}) {
-    states.push(State{w == 0 ? utils::realLength(c) : w, c, a, bg});
+  template <typename F> void pushWith(F f) {
+    replaceTop([&](const NodePtr &top) {
+      auto s = top->state;
+      f(s);
+      return std::make_shared<const Node>(Node{std::move(s), top});
+    });
   }
 };
 
@@ -446,6 +3314,37 @@ public:
   void removeGutter() { gutter = Gutter(); }
   bool markup = true;
   bool raw = false;
+  // Render the markup of the format string before substituting arguments
+  // (see utils::format). Arguments are then printed as-is.
+  bool markupFirst = false;
+  // ColorMode::NONE prints text only, for files and pipes. Defaults to what
+  // stdout supports, and to TRUECOLOR once setSink() is called.
+  ColorMode colorMode = Terminal::colorMode();
+  // Where lines go; its flush policy decides when they reach the sink.
+  OutputBuffer *output = &OutputBuffer::standard();
+
+  // Sends lines to `sink` instead of stdout, through a buffer of its own.
+  // Lines are then rendered in full color and the sink converts them to its
+  // own colorMode, whatever stdout supports.
+  void setSink(Sink &sink,
+               OutputBuffer::Flush policy = OutputBuffer::Flush::LINE) {
+    ownOutput = std::make_shared<OutputBuffer>(sink, policy);
+    output = ownOutput.get();
+    colorMode = ColorMode::TRUECOLOR;
+  }
+
+  bool flush() { return output->flush(); }
+
+  // The gutters a line is printed with. Copies are cheap (one short lock per
+  // gutter) and independent of the printer, so a line can be marked without
+  // changing shared state.
+  struct Gutters {
+    Gutter left, main, right, indent;
+  };
+
+  Gutters gutters() const {
+    return {leftGutter, gutter, rightGutter, indentGutter};
+  }
 
   template <typename S, typename... Args>
   void markLine(fmt::detail::color_type color, std::string mark,
@@ -455,69 +3354,44 @@ public:
   void markLine(std::string mark, const S &fmt_string, const Args &...args) {
     // markLine(fmt::detail::color_type{}, fmt_string, std::forward<const Args
     // &>(args)...);
-    if (rightGutter.enabled) {
-      rightGutter.push(mark);
-      println(fmt_string, std::forward<const Args &>(args)...);
-      rightGutter.pop();
-    } else {
-      auto c = gutter.states.top().content;
-      gutter.push(mark);
-      auto id = utils::realLength(mark) - utils::realLength(c);
-      auto iw = indentGutter.states.top().width;
-      if (iw > id)
-        indentGutter.push(iw - id);
-      println(fmt_string, std::forward<const Args &>(args)...);
-      if (iw > id)
-        indentGutter.pop();
-      gutter.pop();
-    }
+    printLine(marked(mark), fmt_string, std::forward<const Args &>(args)...);
   }
   template <typename S, typename... Args>
   void markLine(fmt::detail::color_type color, const S &fmt_string,
                 const Args &...args) {
-    if (leftGutter.enabled) {
-      leftGutter.push(utils::color(color, "▏"));
-      println(fmt_string, std::forward<const Args &>(args)...);
-      leftGutter.pop();
-    } else {
-      gutter.push(color);
-      println(fmt_string, std::forward<const Args &>(args)...);
-      gutter.pop();
-    }
+    printLine(marked(color), fmt_string, std::forward<const Args &>(args)...);
   }
 
   template <typename S, typename... Args>
   void print(const S &fmt_string, const Args &...args) {
-    if (fmt_string == "")
+    if (raw && !markup && colorMode == ColorMode::TRUECOLOR) {
+      output->write(std::string_view(fmt_string));
       return;
-    std::string msg = fmt_string;
-    if (!raw) {
-      msg = fmt::format(fmt::runtime(fmt_string), std::forward<const Args &>(args)...);
-    }
-    if (markup) {
-      msg = utils::parse(msg);
-    }
-    if (!raw) {
-      fmt::print(fmt::runtime(msg));
-    } else {
-      std::cout << msg;
     }
+    std::string msg;
+    render(msg, fmt_string, std::forward<const Args &>(args)...);
+    output->write(msg);
   }
 
   void println() { println(""); }
 
   void printGutters() {
-    leftGutter.print();
-    gutter.print();
-    rightGutter.print();
-    indentGutter.print();
+    std::string text;
+    renderGutters(text, gutters());
+    output->write(text);
   }
 
   template <typename S, typename... Args>
   void println(const S &fmt_string, const Args &...args) {
-    printGutters();
-    print(fmt_string, std::forward<const Args &>(args)...);
-    std::cout << std::endl;
+    printLine(gutters(), fmt_string, std::forward<const Args &>(args)...);
+  }
+
+  // Prints a line with `g` instead of the printer's own gutters.
+  template <typename S, typename... Args>
+  void printLine(const Gutters &g, const S &fmt_string, const Args &...args) {
+    commit([&](std::string &text) {
+      renderLine(text, g, fmt_string, std::forward<const Args &>(args)...);
+    });
   }
 
   int indent = 0;
@@ -527,22 +3401,120 @@ public:
     gutter.enabled = true;
     rightGutter.enabled = false;
   }
+
+protected:
+  // The gutters markLine() prints a line with.
+  Gutters marked(const std::string &mark) const {
+    auto g = gutters();
+    if (g.right.enabled) {
+      g.right.push(mark);
+    } else {
+      auto c = g.main.top().content;
+      g.main.push(mark);
+      auto id = utils::realLength(mark) - utils::realLength(c);
+      auto iw = g.indent.top().width;
+      if (iw > id)
+        g.indent.push(iw - id);
+    }
+    return g;
+  }
+
+  Gutters marked(fmt::detail::color_type color) const {
+    auto g = gutters();
+    if (g.left.enabled) {
+      g.left.push(utils::styled(ColorMode::TRUECOLOR, fmt::fg(color), "▏"));
+    } else {
+      g.main.push(color);
+    }
+    return g;
+  }
+
+  // Appends the formatted body of a line to `out`.
+  template <typename S, typename... Args>
+  void render(std::string &out, const S &fmt_string, const Args &...args) {
+    vrender(out, fmt_string, fmt::make_format_args(args...));
+  }
+
+  // render() with type-erased arguments.
+  void vrender(std::string &out, std::string_view fmt_string,
+               fmt::format_args args) {
+    if (fmt_string == "")
+      return;
+    if (raw && !markup && colorMode == ColorMode::TRUECOLOR) {
+      out += fmt_string;
+      return;
+    }
+    std::string msg(fmt_string);
+    if (!raw && markup && markupFirst) {
+      msg = utils::vformat(colorMode, fmt_string, args);
+    } else {
+      if (!raw) {
+        msg = fmt::vformat(fmt_string, args);
+      }
+      if (markup && utils::hasMarkup(msg, colorMode)) {
+        msg = utils::parse(msg, colorMode);
+      } else if (!markup) {
+        Ansi::downgrade(msg, colorMode);
+      }
+    }
+    out += msg;
+  }
+
+  void renderGutters(std::string &out, const Gutters &g) const {
+    g.left.render(out, colorMode);
+    g.main.render(out, colorMode);
+    g.right.render(out, colorMode);
+    g.indent.render(out, colorMode);
+  }
+
+  template <typename S, typename... Args>
+  void renderLine(std::string &out, const Gutters &g, const S &fmt_string,
+                  const Args &...args) {
+    renderGutters(out, g);
+    render(out, fmt_string, std::forward<const Args &>(args)...);
+    out += '\n';
+  }
+
+  // Renders whole lines into a per-thread buffer, then hands them to the
+  // output at once, so threads sharing a printer only ever contend for
+  // the copy into the output buffer.
+  template <typename F> void commit(F f) {
+    std::string text;
+    text.swap(scratch());
+    text.clear();
+    f(text);
+    if (!text.empty())
+      output->writeLines(text);
+    text.swap(scratch());
+  }
+
+private:
+  std::shared_ptr<OutputBuffer> ownOutput;
+
+  static std::string &scratch() {
+    static thread_local std::string text;
+    return text;
+  }
 };
 
 class NumberedPrinter : public Printer {
 public:
-  int linenum = 0;
+  std::atomic<int> linenum = 0;
   fmt::detail::color_type fgColor = fmt::rgb(80, 80, 80);
 
   template <typename S, typename... Args>
   void println(const S &fmt_string, const Args &...args) {
-    linenum++;
-    if (linenum < 100)
-      gutter.states.top().width = 2;
-    else
-      gutter.states.top().width = 3;
-    gutter.states.top().content = utils::color(fgColor, "{}", linenum);
-    Printer::println(fmt_string, std::forward<const Args &>(args)...);
+    auto n = ++linenum;
+    auto number = [&](Gutter::State &s) {
+      s.width = n < 100 ? 2 : 3;
+      s.content = utils::styled(ColorMode::TRUECOLOR, fmt::fg(fgColor),
+                                fmt::to_string(n));
+    };
+    // The shared gutter keeps the last number for markLine().
+    gutter.modify(number);
+    auto g = gutters();
+    g.main.modify(number);
+    printLine(g, fmt_string, std::forward<const Args &>(args)...);
   }
   NumberedPrinter() : Printer(1) {
     setGutter(Gutter("", 3));
@@ -558,26 +3530,87 @@ public:
   }
   template <typename S, typename... Args>
   void println(const S &fmt_string, const Args &...args) {
-    std::string l;
-    auto n = 0;
-    std::stringstream ss(fmt_string);
-    std::vector<std::string> lines;
-    while (std::getline(ss, l, '\n')) {
-      lines.push_back(l);
-    }
-    for (auto l : lines) {
-      Printer::println(l);
-    }
+    auto g = gutters();
+    commit([&](std::string &text) {
+      for (auto l : utils::lines(fmt_string)) {
+        renderLine(text, g, l);
+      }
+    });
   }
 };
 
 class HighlightPrinter : public RawPrinter {
 public:
   HighlightPrinter(int i = 0) : RawPrinter(i) {}
+
+  // A stream that prints the JSON fed to it, each line with the gutters as
+  // soon as it is complete. Pass it to end() after the last chunk.
+  JsonStream stream() {
+    auto line = std::make_shared<PendingLine>(PendingLine{gutters(), {}});
+    return JsonStream([this, line](std::string_view out) { write(*line, out); },
+                      colorMode, [this, line] { close(*line); });
+  }
+
+  void end(JsonStream &stream) { stream.finish(); }
+
+  void print(std::istream &in) {
+    auto s = stream();
+    s.feed(in);
+    end(s);
+  }
+
+  bool print(int fd) {
+    auto s = stream();
+    auto ok = s.feed(fd);
+    end(s);
+    return ok;
+  }
+
   template <typename S, typename... Args>
   void println(const S &fmt_string, const Args &...args) {
-    auto text = utils::highlight(fmt_string);
-    RawPrinter::println(text);
+    auto s = stream();
+    s.feed(std::string_view(fmt_string));
+    end(s);
+  }
+
+private:
+  struct PendingLine {
+    Gutters gutters;
+    std::string text;
+    bool open = false;
+  };
+
+  // Lines are committed whole; only a line longer than the output buffer
+  // goes out in pieces.
+  void write(PendingLine &line, std::string_view out) {
+    while (!out.empty()) {
+      if (!line.open) {
+        line.text.clear();
+        renderGutters(line.text, line.gutters);
+        line.open = true;
+      }
+      auto nl = out.find('\n');
+      if (nl == std::string_view::npos) {
+        line.text += out;
+        if (line.text.size() >= OutputBuffer::CAPACITY) {
+          output->write(line.text);
+          line.text.clear();
+        }
+        return;
+      }
+      line.text += out.substr(0, nl + 1);
+      output->writeLines(line.text);
+      line.open = false;
+      out.remove_prefix(nl + 1);
+    }
+  }
+
+  void close(PendingLine &line) {
+    if (!line.open)
+      return;
+    line.text += '\n';
+    output->writeLines(line.text);
+    line.open = false;
   }
 };
 
@@ -591,43 +3624,65 @@ public:
 
   template <typename S, typename... Args>
   void println(const S &fmt_string, const Args &...args) {
-    auto m = utils::italic(utils::color(fgColor, mark));
-    setGutter(Gutter(m, mark.size()));
+    auto m = dim(mark, fmt::emphasis::italic);
+    auto g = gutters();
+    g.main = Gutter(m, mark.size());
     auto line = fmt::format(fmt::runtime(fmt_string), std::forward<const Args &>(args)...);
-    line = utils::italic(utils::color(fgColor, line));
-    Printer::println(line);
+    line = dim(line, fmt::emphasis::italic);
+    printLine(g, line);
   }
 
+  // The three gutters of a block and the comment style are rendered once,
+  // and lines are styled in thread-local buffers, so a block of any length
+  // costs the same few allocations once the buffers have grown.
   template <typename S, typename... Args>
   void printBlock(const S &fmt_string, const Args &...args) {
-    std::string l;
-    auto line = fmt::format(fmt::runtime(fmt_string), std::forward<const Args &>(args)...);
-    auto n = 0;
-    std::stringstream ss(line);
-    std::vector<std::string> lines;
-    while (std::getline(ss, l, '\n')) {
-      lines.push_back(l);
-    }
-    for (auto l : lines) {
-      auto fl = utils::italic(utils::color(fgColor, l));
-      if (n == 0) {
-        gutter.push(utils::color(fgColor, blockMark1));
-      } else if (n == lines.size() - 1) {
-        gutter.push(utils::color(fgColor, blockMark3));
-      } else {
-        gutter.push(utils::color(fgColor, blockMark2));
-      }
-      Printer::println(fl);
-      gutter.pop();
-      n++;
+    thread_local std::string block, line;
+    block.clear();
+    fmt::format_to(std::back_inserter(block), fmt::runtime(fmt_string),
+                   std::forward<const Args &>(args)...);
+    auto lines = utils::lines(block);
+    std::string prefixes[3];
+    for (auto i = 0; auto mark : {&blockMark1, &blockMark2, &blockMark3}) {
+      auto g = gutters();
+      g.main.push(dim(*mark));
+      renderGutters(prefixes[i++], g);
     }
+    Attributes style;
+    style |= fmt::fg(fgColor) | fmt::emphasis::italic;
+    std::string open;
+    Ansi::writeTransition(Attributes{}, style, open, ColorMode::TRUECOLOR);
+    commit([&](std::string &text) {
+      auto first = true;
+      for (auto it = lines.begin(); it != lines.end(); first = false) {
+        line.assign(open);
+        line += *it;
+        line += "\x1b[0m";
+        auto last = ++it == lines.end();
+        text += prefixes[first ? 0 : last ? 2 : 1];
+        if (markup && utils::hasMarkup(line, colorMode))
+          utils::renderMarkup(line, text, colorMode);
+        else if (!markup)
+          Ansi::downgrade(line, colorMode, text);
+        else
+          text += line;
+        text += '\n';
+      }
+    });
   }
 
   CommentPrinter() : Printer(1) {
-    auto m = utils::italic(utils::color(fgColor, mark));
+    auto m = dim(mark, fmt::emphasis::italic);
     setGutter(Gutter(m, mark.size()));
     gutter.push(Align::RIGHT);
   }
+
+private:
+  // Comment text in fgColor. Full color escapes, which rendering converts
+  // to the printer's colorMode.
+  std::string dim(std::string_view text, fmt::text_style style = {}) const {
+    return utils::styled(ColorMode::TRUECOLOR, fmt::fg(fgColor) | style, text);
+  }
 };
 
 class PrinterWithStatusBar : public Printer {
@@ -635,22 +3690,730 @@ public:
   int barWidth = 80;
   std::string statusBarChars = utils::yellow("");
   std::string statusBar = "";
+  // When set, called for the bar's text on every redraw instead of reading
+  // statusBar, e.g. to show counters kept in atomics.
+  std::function<std::string()> statusBarText;
   PrinterWithStatusBar() : Printer() { rebuild(); }
+  virtual ~PrinterWithStatusBar() { refresh(0); }
   void rebuild() {
     statusBar = utils::repeat(statusBarChars,
-                              barWidth / utils::realLength(statusBarChars));
+                              barWidth / std::max(1, utils::realLength(statusBarChars)));
   }
+  // Prints the line above the status bar and redraws the bar below it, in
+  // one write.
   template <typename S, typename... Args>
   void println(const S &fmt_string, const Args &...args) {
-    utils::up();
-    utils::clearLine();
-    Printer::println(fmt_string, std::forward<const Args &>(args)...);
-    Printer::println(statusBar);
+    auto g = gutters();
+    std::lock_guard lock(frameMutex);
+    commit([&](std::string &text) {
+      lines.clear();
+      renderLine(lines, g, fmt_string, std::forward<const Args &>(args)...);
+      screen.print(lines, renderRegion(g), text);
+    });
   }
+
+  // Redraws the status bar, writing only the cells that changed. While a
+  // refresh thread runs, only marks the bar for its next frame.
   void update() {
-    utils::up();
-    utils::clearLine();
-    Printer::println(statusBar);
+    if (refreshing.load(std::memory_order_relaxed)) {
+      dirty.store(true, std::memory_order_release);
+      return;
+    }
+    redraw();
+  }
+
+  // With `fps` > 0, redraws the bar from a background thread at most `fps`
+  // times a second, and only when update() was called since the last
+  // frame. refresh(0) stops the thread and draws what is still pending.
+  // While it runs, the bar has to come from statusBarText: statusBar is
+  // read by the thread.
+  void refresh(int fps) {
+    if (ticker.joinable()) {
+      {
+        std::lock_guard lock(tickMutex);
+        stopping = true;
+      }
+      tick.notify_one();
+      ticker.join();
+      stopping = false;
+      refreshing.store(false, std::memory_order_relaxed);
+      if (dirty.exchange(false, std::memory_order_acquire) || poll)
+        redraw();
+    }
+    if (fps <= 0)
+      return;
+    refreshing.store(true, std::memory_order_relaxed);
+    ticker = std::thread([this, interval = std::chrono::nanoseconds(
+                                    std::chrono::seconds(1)) / fps] {
+      auto next = std::chrono::steady_clock::now();
+      std::unique_lock lock(tickMutex);
+      for (;;) {
+        // After a stall (a slow sink, a suspended process) the missed
+        // frames are dropped: one is drawn and the schedule restarts there.
+        next = std::max(next + interval, std::chrono::steady_clock::now());
+        if (tick.wait_until(lock, next, [&] { return stopping; }))
+          break;
+        if (!dirty.exchange(false, std::memory_order_acquire) && !poll)
+          continue;
+        lock.unlock();
+        redraw();
+        lock.lock();
+      }
+    });
+  }
+
+protected:
+  // Set by subclasses whose rows read their state straight from atomics:
+  // the refresh thread then redraws on every tick, and the diff turns
+  // ticks where nothing changed into no output.
+  bool poll = false;
+  Screen screen;
+  // Frames have to reach the terminal in the order they were diffed.
+  std::mutex frameMutex;
+  std::vector<std::string_view> rows;
+
+  // Renders the rows of the live region, under frameMutex. The views have
+  // to stay valid until the next call.
+  virtual const std::vector<std::string_view> &renderRegion(const Gutters &g) {
+    rows.assign({renderBar(g)});
+    return rows;
+  }
+
+  std::string_view renderBar(const Gutters &g) {
+    bar.clear();
+    renderGutters(bar, g);
+    if (statusBarText)
+      render(bar, statusBarText());
+    else
+      render(bar, statusBar);
+    return bar;
+  }
+
+  // Draws the current frame.
+  void redraw() {
+    auto g = gutters();
+    std::lock_guard lock(frameMutex);
+    commit([&](std::string &text) { screen.draw(renderRegion(g), text); });
+  }
+
+private:
+  std::string lines, bar;
+
+  std::atomic<bool> refreshing{false};
+  std::atomic<bool> dirty{false};
+  bool stopping = false;
+  std::mutex tickMutex;
+  std::condition_variable tick;
+  std::thread ticker;
+};
+
+// One progress bar per job, pinned below the log as a live region. Workers
+// only touch the atomics of their Bar; a refresh thread renders the bars
+// whose numbers moved and writes all of a frame's changes at once.
+class PrinterWithProgressBars : public PrinterWithStatusBar {
+public:
+  struct alignas(64) Bar {
+    Bar(std::string label, std::uint64_t total)
+        : label(std::move(label)), total(total),
+          labelLength(utils::realLength(
+              utils::parse(this->label, ColorMode::NONE))) {}
+
+    const std::string label;
+    std::atomic<std::uint64_t> done{0};
+    std::atomic<std::uint64_t> total;
+
+    void advance(std::uint64_t n = 1) {
+      done.fetch_add(n, std::memory_order_relaxed);
+    }
+
+  private:
+    friend class PrinterWithProgressBars;
+    // Columns the label takes once its markup is rendered.
+    const int labelLength;
+    // The numbers `row` was rendered from.
+    std::uint64_t shownDone = -1, shownTotal = -1;
+    std::string row;
+  };
+
+  int labelWidth = 20;
+  int barLength = 40;
+
+  // The status bar is left out of the region unless it is given text.
+  // Nothing is drawn until refresh(fps) starts the refresh thread, which
+  // should happen after the sink and settings are in place: the thread
+  // reads them.
+  PrinterWithProgressBars() {
+    statusBar.clear();
+    poll = true;
+  }
+  ~PrinterWithProgressBars() { refresh(0); }
+
+  // The returned bar stays valid until it is passed to finish().
+  Bar &add(std::string label, std::uint64_t total) {
+    std::lock_guard lock(frameMutex);
+    return bars.emplace_back(std::move(label), total);
+  }
+
+  // Takes `bar` out of the region and prints its final state above it.
+  void finish(Bar &bar) {
+    auto g = gutters();
+    std::lock_guard lock(frameMutex);
+    commit([&](std::string &text) {
+      renderPrefix(g);
+      finished.assign(renderRow(bar));
+      finished += '\n';
+      bars.remove_if([&](const Bar &b) { return &b == &bar; });
+      screen.print(finished, renderRegion(g), text);
+    });
+  }
+
+protected:
+  const std::vector<std::string_view> &renderRegion(const Gutters &g) override {
+    renderPrefix(g);
+    rows.clear();
+    for (auto &bar : bars)
+      rows.push_back(renderRow(bar));
+    if (!statusBar.empty() || statusBarText)
+      rows.push_back(renderBar(g));
+    return rows;
+  }
+
+private:
+  std::list<Bar> bars;
+  std::string prefix, finished;
+
+  // Renders the gutters every row starts with; rows are rendered again
+  // when they change.
+  void renderPrefix(const Gutters &g) {
+    std::string text;
+    renderGutters(text, g);
+    if (text == prefix)
+      return;
+    prefix.swap(text);
+    for (auto &bar : bars)
+      bar.shownDone = -1;
+  }
+
+  std::string_view renderRow(Bar &bar) {
+    auto done = bar.done.load(std::memory_order_relaxed);
+    auto total = bar.total.load(std::memory_order_relaxed);
+    if (done == bar.shownDone && total == bar.shownTotal)
+      return bar.row;
+    bar.shownDone = done;
+    bar.shownTotal = total;
+    auto fraction = total ? std::min(1.0, double(done) / total) : 0.0;
+    auto filled = int(fraction * barLength);
+    auto pad = std::max(0, labelWidth - bar.labelLength);
+    bar.row = prefix;
+    bar.row += utils::parse(
+        fmt::format("{}{:{}} <green>{}</green><color=#505050>{}</color> "
+                    "{:>3}% {}/{}",
+                    bar.label, "", pad, utils::repeat("━", filled),
+                    utils::repeat("━", barLength - filled),
+                    int(fraction * 100), done, total),
+        colorMode);
+    return bar.row;
+  }
+};
+
+// Records lines instead of rendering them: println() stores the identity of
+// the format string, the arguments and the gutter states in a compact binary
+// form, and LogDecoder renders the recording later. Format strings and gutters
+// are written out once, when first seen, and referred to by id after that.
+// A line takes no lock of the recorder's: each thread finds format ids in a
+// cache of its own, keyed by the address of the format string, and defines
+// gutters in a block of ids that no other thread uses.
+// Arithmetic, char and pointer arguments are stored by value and strings
+// are copied. Other types don't compile: their format spec is only known to
+// fmt, so they have to be formatted before they are recorded.
+//
+// A recording is a sequence of records in host byte order, each starting
+// with its Record byte:
+//   HEADER  "LPLOG" and a version byte; ids start over
+//   FORMAT  u32 id, u32 size, the format string
+//   GUTTERS u32 id, u32 size, the top state of each of the four gutters;
+//           replaces an earlier definition of the id
+//   LINE    u32 format, u32 gutters, u32 size, the arguments
+//   TEXT    u32 format, u32 size, the arguments (print(), no gutters)
+//   PREFIX  u32 gutters (printGutters(), the gutters alone)
+// Each argument is its Type byte followed by the value, and each gutter
+// state is enabled, width, align, bgColor (is_rgb and a u32) and content.
+// Strings are a u32 size and the bytes. Gutter ids are reused: a thread
+// redefines its own ids in turn, and the ids of a thread that exited go to
+// the next new one, so there are never more than GUTTERS_PER_THREAD per
+// live thread.
+class RecordingPrinter : public Printer {
+public:
+  enum Record : char {
+    HEADER = 'H',
+    FORMAT = 'F',
+    GUTTERS = 'G',
+    LINE = 'L',
+    TEXT = 'T',
+    PREFIX = 'P'
+  };
+  enum Type : char { INT, UINT, BOOL, CHAR, FLOAT, DOUBLE, POINTER, STRING };
+  static constexpr std::string_view MAGIC = "LPLOG\x01";
+
+  // Records are binary, so they reach `sink` without color conversion.
+  RecordingPrinter(Sink &sink) {
+    setSink(sink, OutputBuffer::Flush::FULL);
+    output->raw = true;
+    std::string header(1, HEADER);
+    header += MAGIC;
+    output->writeLines(header);
+  }
+
+  template <typename S, typename... Args>
+  void print(const S &fmt_string, const Args &...args) {
+    record(TEXT, fmt_string, nullptr, args...);
+  }
+
+  void println() { println(""); }
+
+  template <typename S, typename... Args>
+  void println(const S &fmt_string, const Args &...args) {
+    printLine(gutters(), fmt_string, args...);
+  }
+
+  template <typename S, typename... Args>
+  void printLine(const Gutters &g, const S &fmt_string, const Args &...args) {
+    record(LINE, fmt_string, &g, args...);
+  }
+
+  template <typename S, typename... Args>
+  void markLine(std::string mark, const S &fmt_string, const Args &...args) {
+    printLine(marked(mark), fmt_string, args...);
+  }
+
+  template <typename S, typename... Args>
+  void markLine(fmt::detail::color_type color, const S &fmt_string,
+                const Args &...args) {
+    printLine(marked(color), fmt_string, args...);
+  }
+
+  void printGutters() {
+    auto g = gutters();
+    commit([&](std::string &text) {
+      auto id = gutterId(g, text);
+      text += PREFIX;
+      put(text, id);
+    });
+  }
+
+  template <typename V> static void put(std::string &out, V value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  static void putString(std::string &out, std::string_view text) {
+    put(out, std::uint32_t(text.size()));
+    out += text;
+  }
+
+  template <typename T> static void encode(std::string &out, const T &value) {
+    if constexpr (std::is_same_v<T, bool>) {
+      out += BOOL;
+      put(out, value);
+    } else if constexpr (std::is_same_v<T, char>) {
+      out += CHAR;
+      put(out, value);
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      out += INT;
+      put(out, std::int64_t(value));
+    } else if constexpr (std::is_integral_v<T>) {
+      out += UINT;
+      put(out, std::uint64_t(value));
+    } else if constexpr (std::is_same_v<T, float>) {
+      out += FLOAT;
+      put(out, value);
+    } else if constexpr (std::is_floating_point_v<T>) {
+      out += DOUBLE;
+      put(out, double(value));
+    } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+      out += STRING;
+      putString(out, value);
+    } else if constexpr (std::is_pointer_v<T>) {
+      out += POINTER;
+      put(out, std::uintptr_t(value));
+    } else if constexpr (std::is_null_pointer_v<T>) {
+      out += POINTER;
+      put(out, std::uintptr_t(0));
+    } else {
+      static_assert(sizeof(T) == 0, "RecordingPrinter records arithmetic, "
+                                    "pointer and string arguments only");
+    }
+  }
+
+  // Gutter ids a thread has; the oldest is redefined when they run out.
+  static constexpr std::uint32_t GUTTERS_PER_THREAD = 32;
+
+private:
+  // Blocks of GUTTERS_PER_THREAD gutter ids, one per recording thread.
+  struct Blocks {
+    std::mutex mutex;
+    std::vector<std::uint32_t> free;
+    std::uint32_t count = 0;
+
+    std::uint32_t acquire() {
+      std::lock_guard lock(mutex);
+      if (free.empty())
+        return count++;
+      auto block = free.back();
+      free.pop_back();
+      return block;
+    }
+
+    void release(std::uint32_t block) {
+      std::lock_guard lock(mutex);
+      free.push_back(block);
+    }
+  };
+
+  // The gutters one thread defined for one recorder, by id within its block.
+  // Keeping them keeps their state ids unique.
+  struct LocalGutters {
+    std::uint64_t recorder;
+    std::weak_ptr<Blocks> blocks;
+    std::uint32_t block;
+    std::uint32_t last = 0, next = 0;
+    std::array<std::array<const void *, 4>, GUTTERS_PER_THREAD> keys{};
+    std::array<std::optional<Gutters>, GUTTERS_PER_THREAD> kept;
+
+    LocalGutters(std::uint64_t recorder, const std::shared_ptr<Blocks> &blocks)
+        : recorder(recorder), blocks(blocks), block(blocks->acquire()) {}
+    LocalGutters(const LocalGutters &) = delete;
+    ~LocalGutters() {
+      if (auto b = blocks.lock())
+        b->release(block);
+    }
+  };
+
+  struct CachedFormat {
+    std::uint64_t recorder = 0;
+    const char *data = nullptr;
+    // The recorder's copy; only read while `recorder` is alive.
+    std::string_view text;
+    std::uint32_t id = 0;
+  };
+
+  static inline std::atomic<std::uint64_t> recorders = 0;
+  const std::uint64_t serial = ++recorders;
+  std::shared_ptr<Blocks> blocks = std::make_shared<Blocks>();
+
+  // Guards the format strings, which are shared by all threads.
+  std::mutex mutex;
+  std::deque<std::string> formatTexts;
+  std::unordered_map<std::string_view, std::uint32_t> formatIds;
+
+  template <typename... Args>
+  void record(Record kind, std::string_view fmt_string, const Gutters *g,
+              const Args &...args) {
+    auto format = formatId(fmt_string);
+    commit([&](std::string &text) {
+      auto gutters = g ? gutterId(*g, text) : 0;
+      text += kind;
+      put(text, format);
+      if (g)
+        put(text, gutters);
+      auto size = text.size();
+      put(text, std::uint32_t(0));
+      (encode(text, args), ...);
+      auto n = std::uint32_t(text.size() - size - sizeof(n));
+      std::memcpy(text.data() + size, &n, sizeof(n));
+    });
+  }
+
+  // A format string is usually a literal, passed at the same address every
+  // time. A hit compares the text with the recorded copy but hashes nothing.
+  std::uint32_t formatId(std::string_view fmt_string) {
+    static thread_local std::array<CachedFormat, 64> cache;
+    auto address = reinterpret_cast<std::uintptr_t>(fmt_string.data());
+    auto &slot = cache[(address * 0x9e3779b97f4a7c15u) >> 58];
+    if (slot.recorder == serial && slot.data == fmt_string.data() &&
+        slot.text == fmt_string)
+      return slot.id;
+    std::lock_guard lock(mutex);
+    auto id = intern(fmt_string);
+    slot = CachedFormat{serial, fmt_string.data(), formatTexts[id], id};
+    return id;
+  }
+
+  // Definitions are written under the mutex, so they always precede the
+  // lines that use them.
+  std::uint32_t intern(std::string_view fmt_string) {
+    auto it = formatIds.find(fmt_string);
+    if (it != formatIds.end())
+      return it->second;
+    std::uint32_t id = formatTexts.size();
+    auto &text = formatTexts.emplace_back(fmt_string);
+    formatIds.emplace(text, id);
+    std::string record;
+    define(record, FORMAT, id, text);
+    output->writeLines(record);
+    return id;
+  }
+
+  LocalGutters &localGutters() {
+    static thread_local std::vector<std::unique_ptr<LocalGutters>> locals;
+    for (auto &local : locals) {
+      if (local->recorder == serial)
+        return *local;
+    }
+    std::erase_if(locals, [](auto &local) { return local->blocks.expired(); });
+    return *locals.emplace_back(std::make_unique<LocalGutters>(serial, blocks));
+  }
+
+  // Appends a GUTTERS record to `out` when `g` is new to this thread. The
+  // line that uses it follows in the same write.
+  std::uint32_t gutterId(const Gutters &g, std::string &out) {
+    auto &local = localGutters();
+    std::array<const void *, 4> key = {g.left.stateId(), g.main.stateId(),
+                                       g.right.stateId(), g.indent.stateId()};
+    auto base = local.block * GUTTERS_PER_THREAD;
+    if (local.kept[local.last] && local.keys[local.last] == key)
+      return base + local.last;
+    for (std::uint32_t i = 0; i < GUTTERS_PER_THREAD; i++) {
+      if (local.kept[i] && local.keys[i] == key) {
+        local.last = i;
+        return base + i;
+      }
+    }
+    auto i = local.next;
+    local.next = (i + 1) % GUTTERS_PER_THREAD;
+    local.last = i;
+    local.keys[i] = key;
+    local.kept[i].emplace(g);
+    std::string states;
+    for (auto gutter : {&g.left, &g.main, &g.right, &g.indent}) {
+      auto state = gutter->top();
+      put(states, gutter->enabled);
+      put(states, std::int32_t(state.width));
+      put(states, state.align);
+      // Field by field: the padding in color_type is not initialized.
+      auto &bg = state.bgColor;
+      put(states, bg.is_rgb);
+      put(states, bg.is_rgb ? bg.value.rgb_color
+                            : std::uint32_t(bg.value.term_color));
+      putString(states, state.content);
+    }
+    define(out, GUTTERS, base + i, states);
+    return base + i;
+  }
+
+  static void define(std::string &out, Record kind, std::uint32_t id,
+                     std::string_view text) {
+    out += kind;
+    put(out, id);
+    putString(out, text);
+  }
+};
+
+// Renders a recording made by RecordingPrinter with its own settings and
+// output, as if the lines had been printed by it.
+class LogDecoder : public Printer {
+public:
+  // Renders the complete records in what was fed so far; the rest waits for
+  // more data. Returns false once the data turns out not to be a recording.
+  bool feed(std::string_view data) {
+    if (!valid)
+      return false;
+    pending.append(data.data(), data.data() + data.size());
+    std::size_t pos = 0;
+    while (valid && pos < pending.size()) {
+      auto next = decode(pos);
+      if (next == pos)
+        break;
+      pos = next;
+    }
+    pending.erase(0, pos);
+    return valid;
+  }
+
+  // True when nothing is left waiting for more data.
+  bool done() const { return pending.empty(); }
+
+private:
+  using Record = RecordingPrinter::Record;
+  using Type = RecordingPrinter::Type;
+
+  std::string pending;
+  bool valid = true;
+  bool started = false;
+  std::unordered_map<std::uint32_t, std::string> formats;
+  // Gutter ids are reused, so this only grows with the recording threads.
+  std::unordered_map<std::uint32_t, std::string> prefixes;
+
+  template <typename V> bool get(std::size_t &pos, V &value) const {
+    if (pending.size() - pos < sizeof(value))
+      return false;
+    std::memcpy(&value, pending.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+  }
+
+  bool getString(std::size_t &pos, std::string_view &text) const {
+    std::uint32_t size;
+    if (!get(pos, size) || pending.size() - pos < size)
+      return false;
+    text = std::string_view(pending).substr(pos, size);
+    pos += size;
+    return true;
+  }
+
+  // Renders the record at `pos` and returns where the next one starts, or
+  // `pos` if the record is not complete yet.
+  std::size_t decode(std::size_t pos) {
+    auto start = pos;
+    auto kind = Record(pending[pos++]);
+    if (!started && kind != RecordingPrinter::HEADER) {
+      valid = false;
+      return start;
+    }
+    std::uint32_t id, gutters = 0;
+    std::string_view text;
+    switch (kind) {
+    case RecordingPrinter::HEADER: {
+      auto size = RecordingPrinter::MAGIC.size();
+      if (pending.size() - pos < size)
+        return start;
+      valid = pending.compare(pos, size, RecordingPrinter::MAGIC) == 0;
+      started = true;
+      formats.clear();
+      prefixes.clear();
+      return pos + size;
+    }
+    case RecordingPrinter::FORMAT:
+      if (!get(pos, id) || !getString(pos, text))
+        return start;
+      formats[id] = text;
+      return pos;
+    case RecordingPrinter::GUTTERS: {
+      if (!get(pos, id) || !getString(pos, text))
+        return start;
+      Gutters g;
+      std::size_t states = text.data() - pending.data();
+      for (auto gutter : {&g.left, &g.main, &g.right, &g.indent}) {
+        Gutter::State state;
+        std::int32_t width = 0;
+        bool rgb = false;
+        std::uint32_t bg = 0;
+        std::string_view content;
+        valid = get(states, gutter->enabled) && get(states, width) &&
+                get(states, state.align) && get(states, rgb) &&
+                get(states, bg) && getString(states, content) && valid;
+        state.width = width;
+        if (rgb)
+          state.bgColor = fmt::rgb(bg);
+        else
+          state.bgColor = fmt::terminal_color(bg);
+        state.content = content;
+        gutter->modify([&](Gutter::State &s) { s = state; });
+      }
+      auto &prefix = prefixes[id];
+      prefix.clear();
+      renderGutters(prefix, g);
+      return pos;
+    }
+    case RecordingPrinter::PREFIX:
+      if (!get(pos, id))
+        return start;
+      if (auto it = prefixes.find(id); it != prefixes.end()) {
+        output->write(it->second);
+        return pos;
+      }
+      valid = false;
+      return start;
+    case RecordingPrinter::LINE:
+    case RecordingPrinter::TEXT:
+      if (!get(pos, id) ||
+          (kind == RecordingPrinter::LINE && !get(pos, gutters)) ||
+          !getString(pos, text))
+        return start;
+      render(kind, id, gutters, text);
+      return pos;
+    }
+    valid = false;
+    return start;
+  }
+
+  void render(Record kind, std::uint32_t format, std::uint32_t gutters,
+              std::string_view args) {
+    fmt::dynamic_format_arg_store<fmt::format_context> store;
+    std::size_t pos = args.data() - pending.data();
+    auto end = pos + args.size();
+    while (valid && pos < end) {
+      auto type = Type(pending[pos++]);
+      auto ok = false;
+      switch (type) {
+      case RecordingPrinter::INT:
+        ok = push<std::int64_t>(pos, store);
+        break;
+      case RecordingPrinter::UINT:
+        ok = push<std::uint64_t>(pos, store);
+        break;
+      case RecordingPrinter::BOOL:
+        ok = push<bool>(pos, store);
+        break;
+      case RecordingPrinter::CHAR:
+        ok = push<char>(pos, store);
+        break;
+      case RecordingPrinter::FLOAT:
+        ok = push<float>(pos, store);
+        break;
+      case RecordingPrinter::DOUBLE:
+        ok = push<double>(pos, store);
+        break;
+      case RecordingPrinter::POINTER: {
+        std::uintptr_t value;
+        if ((ok = get(pos, value)))
+          store.push_back(reinterpret_cast<const void *>(value));
+        break;
+      }
+      case RecordingPrinter::STRING: {
+        std::string_view text;
+        if ((ok = getString(pos, text)))
+          store.push_back(text);
+        break;
+      }
+      }
+      valid = ok && pos <= end;
+    }
+    // Ids that no FORMAT or GUTTERS record defined mean the data is not
+    // what a RecordingPrinter wrote.
+    auto fmt_it = formats.find(format);
+    auto prefix_it = prefixes.find(gutters);
+    valid = valid && fmt_it != formats.end() &&
+            (kind == RecordingPrinter::TEXT || prefix_it != prefixes.end());
+    if (!valid)
+      return;
+    auto &fmt_string = fmt_it->second;
+    // Arguments that don't fit the format string mean the data is not what
+    // a RecordingPrinter wrote.
+    try {
+      if (kind == RecordingPrinter::TEXT) {
+        std::string msg;
+        vrender(msg, fmt_string, store);
+        output->write(msg);
+        return;
+      }
+      commit([&](std::string &text) {
+        text += prefix_it->second;
+        vrender(text, fmt_string, store);
+        text += '\n';
+      });
+    } catch (const fmt::format_error &) {
+      valid = false;
+    }
+  }
+
+  template <typename V>
+  bool push(std::size_t &pos,
+            fmt::dynamic_format_arg_store<fmt::format_context> &store) {
+    V value;
+    if (!get(pos, value))
+      return false;
+    store.push_back(value);
+    return true;
   }
 };
 
@@ -693,7 +4456,7 @@ void with_gutter(const M m, const Lines &...args) {
 template <typename... Lines>
 void with_gutter(const Gutter::State s, const Lines &...args) {
   auto p = Printer();
-  p.gutter.states.push(s);
+  p.gutter.push(s);
   std::vector<std::string> lines = {args...};
   for (auto line : lines) {
     p.println(line);
@@ -716,25 +4479,76 @@ void aligned(const Align align, const int width, const Lines &...args) {
   auto p = Printer();
   std::vector<std::string> lines = {args...};
   for (auto content : lines) {
-    content = utils::parse(content);
-    auto f = content.size() - utils::stripEsc(content).size();
-    switch (align) {
-    case Align::LEFT:
-      p.println(fmt::format("{:<{}}", content, width + f));
-      break;
-    case Align::MIDDLE:
-      p.println(fmt::format("{:^{}}", content, width + f));
-      break;
-    case Align::RIGHT:
-      p.println(fmt::format("{:>{}}", content, width + f));
-      break;
-    }
+    p.println(utils::pad(utils::parse(content), width, align));
   }
 }
 
 } // namespace helpers
-// std::string operator""_p(const char *str, std::size_t len) {
-//   return utils::parse(str);
-// }
+// Not constexpr on purpose: reaching one of these while rendering a markup
+// literal turns the problem into a compile error that names it.
+inline void unknownMarkupTag() {}
+inline void unbalancedMarkupTags() {}
+inline void invalidMarkupColor() {}
+
+template <std::size_t N> struct MarkupLiteral {
+  char text[N]{};
+  constexpr MarkupLiteral(const char (&s)[N]) { std::copy_n(s, N, text); }
+  constexpr std::string_view view() const { return {text, N - 1}; }
+};
+
+// Literals are stricter than runtime markup: tags must be built-in, colors
+// valid and every closing tag has to name the element it closes.
+template <MarkupLiteral S> consteval std::size_t renderedLiteralSize() {
+  std::array<std::string_view, MarkupRenderer::MAX_DEPTH> open{};
+  std::size_t depth = 0;
+  auto text = S.view();
+  for (auto pos = text.find('<'); pos != std::string_view::npos;
+       pos = text.find('<', pos)) {
+    auto p = text.data() + pos;
+    MarkupRenderer::Tag tag;
+    if (MarkupRenderer::scanTag(p, text.data() + text.size(), tag) !=
+        MarkupRenderer::TagScan::OK)
+      unbalancedMarkupTags();
+    pos = p - text.data();
+    if (tag.closing) {
+      if (depth == 0 || open[depth - 1] != tag.name)
+        unbalancedMarkupTags();
+      depth--;
+    } else {
+      if (!MarkupRenderer::isBuiltinTag(tag.name))
+        unknownMarkupTag();
+      if ((tag.name == "color" || tag.name == "bgcolor") &&
+          !MarkupRenderer::parseHex(tag.arg))
+        invalidMarkupColor();
+      if (depth == open.size())
+        unbalancedMarkupTags();
+      open[depth++] = tag.name;
+    }
+  }
+  if (depth != 0)
+    unbalancedMarkupTags();
+
+  StaticBuffer<0> out;
+  MarkupRenderer().render(text, out);
+  return out.size();
+}
+
+template <MarkupLiteral S>
+inline constexpr auto renderedLiteral = [] {
+  StaticBuffer<renderedLiteralSize<S>()> out;
+  MarkupRenderer().render(S.view(), out);
+  return out;
+}();
+
+// "<b><red>red</red></b>"_p renders at compile time into a static string.
+// Its colors are truecolor; printers convert them for the terminal.
+template <MarkupLiteral S> consteval const char *operator""_p() {
+  return renderedLiteral<S>.text;
+}
 
 } // namespace LibPrint
+
+// Split only refers to the text it splits, so its iterators stay valid after
+// the view itself is gone.
+template <>
+inline constexpr bool std::ranges::enable_borrowed_range<LibPrint::Split> = true;
@@ -0,0 +1,702 @@
+#include "include/libprint/libprint.hpp"
+#include <atomic>
+#include <codecvt>
+#include <locale>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+using namespace LibPrint;
+
+// Counts heap allocations, to check that iterating a Split does not
+// allocate.
+// Atomic, as the sink and thread benches allocate from worker threads.
+static std::atomic<std::size_t> allocations = 0;
+void *operator new(std::size_t n) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(n))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](std::size_t n) { return operator new(n); }
+// Not inlined, or GCC sees free() on a pointer from operator new.
+[[gnu::noinline]] static void release(void *p) noexcept { std::free(p); }
+void operator delete(void *p) noexcept { release(p); }
+void operator delete(void *p, std::size_t) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete[](void *p, std::size_t) noexcept { release(p); }
+
+// Runs f() n times and returns calls per second. `sink` keeps the results
+// alive so the work is not optimized away.
+template <typename F> double bench(int n, F f) {
+  static std::size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    sink += f().size();
+  }
+  milliseconds_t elapsed = std::chrono::steady_clock::now() - start;
+  return n / (elapsed.count() / 1000);
+}
+
+void report(std::string name, double rate, std::string unit = "lines/s") {
+  fmt::print("  {:<40} {:>14.0f} {}\n", name, rate, unit);
+}
+
+const std::string line = "<b><color=#ffd700>Header text</color></b> "
+                         "<i><color=#505050>16-10-2026 23-16-04</color></i> "
+                         "<red>red</red> <green>green</green>";
+
+void markup() {
+  utils::h2("Markup parser");
+  report("grammar compiled per call", bench(2000, [] {
+           parser p(utils::markupGrammar);
+           p.enable_ast();
+           std::shared_ptr<Ast> ast;
+           std::string content;
+           if (p.parse(line, ast)) {
+             content = utils::process_node(p.optimize_ast(ast));
+           }
+           return content;
+         }));
+  report("shared compiled grammar",
+         bench(20000, [] { return utils::parsePeg(line); }));
+  report("scanner", bench(200000, [] {
+           std::string out;
+           utils::renderMarkup(line, out);
+           return out;
+         }));
+  report("scanner, cached", bench(200000, [] { return utils::parse(line); }));
+  auto stats = utils::markupCache().stats();
+  fmt::print("  cache: {} hits, {} misses, {} evictions, {}/{} entries\n",
+             stats.hits, stats.misses, stats.evictions, stats.size,
+             stats.capacity);
+  utils::registerTag("warn", fmt::fg(fmt::color::orange) | fmt::emphasis::bold);
+  utils::registerTag("ok", fmt::fg(fmt::terminal_color::green));
+  report("scanner, registered tags", bench(200000, [] {
+           std::string out;
+           utils::renderMarkup("<warn>warning</warn> <ok>done</ok> <b>bold</b>",
+                               out);
+           return out;
+         }));
+  // Same text with the same attributes in every cell; the escapes may
+  // differ, since the scanner only writes what changed.
+  Screen::Row scanned, reference;
+  Screen::parse(utils::parse(line), scanned);
+  Screen::parse(utils::parsePeg(line), reference);
+  if (scanned != reference) {
+    fmt::print(stderr, "scanner output differs from peglib reference\n");
+    std::exit(1);
+  }
+}
+
+void plain() {
+  utils::h2("Tag-free lines");
+  auto text = std::string("2026-10-16 23:16:04 worker-3 request handled in 12ms, "
+                          "status=200 bytes=5120 path=/api/v1/items");
+  report("full markup pipeline", bench(1000000, [&] {
+           std::string out;
+           utils::renderMarkup(text, out);
+           return out;
+         }));
+  report("prefilter, then copy", bench(1000000, [&] { return utils::parse(text); }));
+  report("prefilter only", bench(1000000, [&] {
+           return std::string_view(utils::hasMarkup(text) ? "" : "x");
+         }));
+}
+
+void bytes() {
+  utils::h2("Bytes per line");
+  std::vector<std::string> lines = {
+      line,
+      "<b><bgcolor=#eeeeee><color=#222222> black on white </color></bgcolor>"
+      "</b> <b><bgcolor=#11ff11><color=#ff1111> red on green </color>"
+      "</bgcolor></b>",
+      "<i>a <b>b <u>c <red>d</red> c</u> b</b> a</i>",
+      utils::italic(utils::gray("comment <red>FIXME:</red> text")),
+  };
+  for (auto &l : lines) {
+    fmt::print("  {:>4} -> {:>4} bytes  {}\n", utils::parsePeg(l).size(),
+               utils::parse(l).size(), utils::parse(l));
+  }
+}
+
+void formatting() {
+  utils::h2("Formatting");
+  auto fmt_string = "<b><color=#ffd700>{}</color></b> <i>{:>10}</i>";
+  for (auto size : {16, 4096}) {
+    auto payload = std::string(size, 'x');
+    report(fmt::format("format, then markup ({} byte arg)", size),
+           bench(100000, [&] {
+             std::string out;
+             utils::renderMarkup(
+                 fmt::format(fmt::runtime(fmt_string), payload, size), out);
+             return out;
+           }));
+    report(fmt::format("markup-first ({} byte arg)", size),
+           bench(100000, [&] { return utils::format(fmt_string, payload, size); }));
+  }
+}
+
+void streaming() {
+  utils::h2("Streaming");
+  std::string document;
+  while (document.size() < 8 * 1024 * 1024) {
+    document += line + "\n";
+  }
+  std::size_t bytes = 0;
+  MarkupStream stream([&](std::string_view out) { bytes += out.size(); });
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < document.size(); i += 64 * 1024) {
+    stream.feed(std::string_view(document).substr(i, 64 * 1024));
+  }
+  stream.finish();
+  milliseconds_t elapsed = std::chrono::steady_clock::now() - start;
+  fmt::print("  {:<40} {:>14.1f} MB/s ({} bytes out)\n",
+             "8 MB document in 64 KB chunks",
+             document.size() / elapsed.count() / 1000, bytes);
+}
+
+void stripping() {
+  utils::h2("Stripping");
+  report("render with color", bench(1000000, [&] { return utils::parse(line); }));
+  report("strip to text", bench(1000000, [&] {
+           return utils::parse(line, ColorMode::NONE);
+         }));
+  report("render, then regex stripEsc", bench(100000, [&] {
+           return utils::stripEsc(utils::parse(line));
+         }));
+  if (utils::parse(line, ColorMode::NONE) != utils::stripEsc(utils::parse(line))) {
+    fmt::print("  stripped text differs from rendered text\n");
+  }
+}
+
+std::string regexStripEsc(std::string str) {
+  std::regex esc_re("\e\[[0-9;]+m");
+  return std::regex_replace(str, esc_re, "");
+}
+
+void escapes() {
+  utils::h2("Escape stripping");
+  auto colored = utils::parse(line);
+  auto text = utils::stripEsc(colored);
+  report("regex_replace", bench(100000, [&] { return regexStripEsc(colored); }));
+  report("scanner, copy", bench(1000000, [&] {
+           return utils::stripEsc(colored);
+         }));
+  std::string work;
+  report("scanner, in place", bench(1000000, [&] {
+           work = colored;
+           work = utils::stripEsc(std::move(work));
+           return std::string_view(work);
+         }));
+  report("scanner, length only", bench(1000000, [&] {
+           return std::string_view(utils::stripEscLength(colored) ? "x" : "");
+         }));
+  report("scanner, no escapes", bench(1000000, [&] {
+           return std::string_view(utils::stripEscLength(text) ? "x" : "");
+         }));
+  if (utils::stripEsc(colored) != regexStripEsc(colored)) {
+    fmt::print("  scanner output differs from regex\n");
+  }
+}
+
+std::string regexHighlight(std::string text) {
+  std::regex b_re(R"([\{\}]+)");
+  std::regex p_re("([,:]+)");
+  std::regex q_re(R"(\"([^\":]+)\")");
+  std::regex k_re("(.*):");
+  std::regex n_re(": ([0-9.]+)");
+  text = std::regex_replace(text, n_re, ": " + utils::blue("$1"));
+  text = std::regex_replace(text, b_re, utils::bold(utils::yellow("$0")));
+  text = std::regex_replace(text, q_re, "\"" + utils::green("$1") + "\"");
+  text = std::regex_replace(text, k_re, utils::bold("$1") + ":");
+  text = std::regex_replace(text, p_re, utils::gray("$0"));
+  return text;
+}
+
+// Runs f() over `text` until at least 200ms have passed and returns MB/s.
+template <typename F> double throughput(const std::string &text, F f) {
+  std::size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  milliseconds_t elapsed{};
+  do {
+    bytes += f(text).size() ? text.size() : 0;
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed.count() < 200);
+  return bytes / elapsed.count() / 1000;
+}
+
+void json() {
+  utils::h2("JSON highlighting");
+  std::string document = "[\n";
+  for (int i = 0; document.size() < 4 * 1024 * 1024; i++) {
+    document += fmt::format(
+        "  {{\"id\": {}, \"name\": \"item {}\", \"url\": "
+        "\"http://example.com/{}\", \"tags\": [1, 2.5, -3e2], "
+        "\"ok\": true}},\n",
+        i, i, i);
+  }
+  document += "  null\n]\n";
+  auto sample = document.substr(0, 256 * 1024);
+  fmt::print("  {:<40} {:>14.1f} MB/s\n", "regex, 256 KB",
+             throughput(sample, regexHighlight));
+  fmt::print("  {:<40} {:>14.1f} MB/s\n", "single pass, 4 MB",
+             throughput(document, [](auto &text) {
+               return JsonHighlighter::highlight(text);
+             }));
+  fmt::print("  {:<40} {:>14.1f} MB/s\n", "stream, 4 MB in 64 KB chunks",
+             throughput(document, [](auto &text) {
+               std::size_t bytes = 0;
+               JsonStream stream([&](std::string_view out) { bytes += out.size(); });
+               for (std::size_t i = 0; i < text.size(); i += JsonStream::CHUNK_SIZE)
+                 stream.feed(std::string_view(text).substr(i, JsonStream::CHUNK_SIZE));
+               stream.finish();
+               return std::string_view(bytes ? "x" : "");
+             }));
+}
+
+std::string formatRule(int l, fmt::detail::color_type rule_color,
+                       bool end_line, bool thin) {
+  return fmt::format(fmt::runtime(utils::color(
+      rule_color, utils::bold(thin ? "{:─^{}}{}" : "{:━^{}}{}", "", l,
+                              end_line ? "\n" : ""))));
+}
+
+std::string streamRepeat(std::string s, int n) {
+  std::ostringstream os;
+  for (int i = 0; i < n; i++)
+    os << s;
+  return os.str();
+}
+
+void rules() {
+  utils::h2("Rules");
+  report("nested fmt::format", bench(100000, [] {
+           return formatRule(80, fmt::color::gray, true, false);
+         }));
+  report("cached rule", bench(1000000, [] {
+           return utils::rule(80, fmt::color::gray, true, false);
+         }));
+  report("ostringstream repeat, 200 glyphs", bench(100000, [] {
+           return streamRepeat("━", 200);
+         }));
+  report("doubling repeat, 200 glyphs", bench(1000000, [] {
+           return utils::repeat("━", 200);
+         }));
+  if (formatRule(57, fmt::color::orange, false, true) !=
+      utils::rule(57, fmt::color::orange, false, true)) {
+    fmt::print("  cached rule differs from fmt::format\n");
+  }
+}
+
+void splitting() {
+  utils::h2("Line splitting");
+  std::string block;
+  for (int i = 0; i < 100000; i++) {
+    block += fmt::format("line {} of a long block\n", i);
+  }
+  report("stringstream + vector, 100k lines", bench(20, [&] {
+           std::stringstream ss(block);
+           std::string l;
+           std::vector<std::string> lines;
+           while (std::getline(ss, l, '\n'))
+             lines.push_back(l);
+           return lines;
+         }), "blocks/s");
+  report("Split view, 100k lines", bench(200, [&] {
+           std::size_t n = 0;
+           for (auto l : utils::lines(block))
+             n += l.size();
+           return std::string_view(n ? "x" : "");
+         }), "blocks/s");
+  auto before = allocations.load();
+  std::size_t n = 0;
+  for (auto l : utils::lines(block))
+    n += l.size();
+  fmt::print("  {} allocations iterating a Split over {} bytes of lines\n",
+             allocations - before, n);
+
+  // The second block finds the buffers grown by the first.
+  FileSink devnull("/dev/null", ColorMode::TRUECOLOR);
+  CommentPrinter comment;
+  comment.setSink(devnull, OutputBuffer::Flush::FULL);
+  comment.printBlock("{}", block);
+  before = allocations.load();
+  comment.printBlock("{}", block);
+  fmt::print("  {} allocations printing it as a comment block\n",
+             allocations - before);
+}
+
+void output() {
+  utils::h2("Output to a pipe");
+  int fds[2];
+  if (pipe(fds) != 0)
+    return;
+  std::thread reader([&] {
+    char chunk[64 * 1024];
+    while (read(fds[0], chunk, sizeof(chunk)) > 0)
+      ;
+  });
+  auto text = std::string("2026-10-16 23:16:04 worker-3 request handled in 12ms");
+  auto file = fdopen(dup(fds[1]), "w");
+  report("fmt::print + flush per line", bench(200000, [&] {
+           fmt::print(file, "{}", fmt::format(fmt::runtime(text)));
+           std::fputc('\n', file);
+           std::fflush(file);
+           return text;
+         }));
+  std::fclose(file);
+  for (auto [name, policy] : {std::pair{"OutputBuffer, flush per line",
+                                        OutputBuffer::Flush::LINE},
+                              std::pair{"OutputBuffer, flush when full",
+                                        OutputBuffer::Flush::FULL}}) {
+    OutputBuffer out(fds[1], policy);
+    auto p = Printer();
+    p.output = &out;
+    report(name, bench(200000, [&] {
+             p.println(text);
+             return text;
+           }));
+  }
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+}
+
+void sinks() {
+  utils::h2("Terminal and file from one line");
+  MemorySink colored, plain(ColorMode::NONE);
+  auto terminal = Printer(), file = Printer();
+  terminal.setSink(colored);
+  file.setSink(plain);
+  file.colorMode = ColorMode::NONE;
+  report("two printers, rendered twice", bench(200000, [&] {
+           terminal.println(line);
+           file.println(line);
+           colored.clear();
+           plain.clear();
+           return line;
+         }));
+  FanoutSink both{&colored, &plain};
+  auto p = Printer();
+  p.setSink(both);
+  report("fan-out, rendered once", bench(200000, [&] {
+           p.println(line);
+           colored.clear();
+           plain.clear();
+           return line;
+         }));
+}
+
+// Per-line println latency in ns, over `threads` threads printing to `sink`.
+// All threads share one printer, as they would share a logger.
+std::vector<double> latencies(Sink &sink, int threads, int lines) {
+  std::vector<std::vector<double>> samples(threads);
+  std::vector<std::thread> workers;
+  auto p = Printer();
+  p.setSink(sink);
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      samples[t].reserve(lines);
+      for (int i = 0; i < lines; i++) {
+        auto start = std::chrono::steady_clock::now();
+        p.println("<b>worker {}</b> request {} handled", t, i);
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        samples[t].push_back(elapsed.count());
+      }
+    });
+  }
+  for (auto &w : workers)
+    w.join();
+  std::vector<double> all;
+  for (auto &s : samples)
+    all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  return all;
+}
+
+void async() {
+  utils::h2("Producer latency, shared printer, sync vs async");
+  int fds[2];
+  if (pipe(fds) != 0)
+    return;
+  std::thread reader([&] {
+    char chunk[64 * 1024];
+    while (read(fds[0], chunk, sizeof(chunk)) > 0)
+      ;
+  });
+  FdSink pipeSink(fds[1]);
+  fmt::print("  {:<10} {:>12} {:>12} {:>12} {:>12}\n", "threads", "sync p50",
+             "sync p99", "async p50", "async p99");
+  for (auto threads : {1, 2, 4, 8, 16, 32}) {
+    auto sync = latencies(pipeSink, threads, 20000);
+    AsyncSink queue(pipeSink, 8192);
+    auto async = latencies(queue, threads, 20000);
+    queue.drain();
+    auto at = [](auto &v, double q) { return v[static_cast<std::size_t>(q * (v.size() - 1))]; };
+    fmt::print("  {:<10} {:>10.0f}ns {:>10.0f}ns {:>10.0f}ns {:>10.0f}ns\n",
+               threads, at(sync, 0.5), at(sync, 0.99), at(async, 0.5),
+               at(async, 0.99));
+  }
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+}
+
+// Lines per second from `threads` threads sharing `p`; `print` prints one.
+template <typename F> double shared(int threads, int lines, F print) {
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      for (int i = 0; i < lines; i++)
+        print(t, i);
+    });
+  }
+  for (auto &w : workers)
+    w.join();
+  milliseconds_t elapsed = std::chrono::steady_clock::now() - start;
+  return threads * lines / (elapsed.count() / 1000);
+}
+
+void threads() {
+  utils::h2("One printer, many threads");
+  FileSink devnull("/dev/null", ColorMode::TRUECOLOR);
+  auto p = Printer(1);
+  p.setSink(devnull, OutputBuffer::Flush::FULL);
+  p.gutter.push(1, utils::green("┃"), Align::MIDDLE);
+  std::mutex mutex;
+  fmt::print("  {:<10} {:>16} {:>16}\n", "threads", "mutex, lines/s",
+             "lines/s");
+  for (auto threads : {1, 2, 4, 8}) {
+    auto locked = shared(threads, 100000, [&](int t, int i) {
+      std::lock_guard lock(mutex);
+      p.println("<b>worker {}</b> request {} handled", t, i);
+    });
+    auto free = shared(threads, 100000, [&](int t, int i) {
+      p.println("<b>worker {}</b> request {} handled", t, i);
+    });
+    fmt::print("  {:<10} {:>16.0f} {:>16.0f}\n", threads, locked, free);
+  }
+  p.flush();
+}
+
+// Nearest of the 16 system colors by scanning them all, for comparison
+// with Palette::to16().
+uint8_t scan16(uint32_t c) {
+  auto distance = [](uint32_t a, uint32_t b) {
+    int dr = (a >> 16 & 0xff) - (b >> 16 & 0xff);
+    int dg = (a >> 8 & 0xff) - (b >> 8 & 0xff);
+    int db = (a & 0xff) - (b & 0xff);
+    return dr * dr + dg * dg + db * db;
+  };
+  uint8_t best = 0;
+  for (uint8_t i = 1; i < 16; i++) {
+    if (distance(c, Palette::SYSTEM[i]) < distance(c, Palette::SYSTEM[best]))
+      best = i;
+  }
+  return best;
+}
+
+void colors() {
+  utils::h2("Color downgrade");
+  uint32_t c = 0;
+  std::string sum(1, 0);
+  report("rgb to 16, scan", bench(1000000, [&] {
+           sum[0] += scan16(c += 0x010203);
+           return sum;
+         }), "colors/s");
+  report("rgb to 16, table", bench(1000000, [&] {
+           sum[0] += Palette::to16(c += 0x010203);
+           return sum;
+         }), "colors/s");
+  report("rgb to 256", bench(1000000, [&] {
+           sum[0] += Palette::to256(c += 0x010203);
+           return sum;
+         }), "colors/s");
+  auto colored = utils::parse(line, ColorMode::TRUECOLOR);
+  for (auto [name, mode] : {std::pair{"256", ColorMode::ANSI256},
+                            std::pair{"16", ColorMode::ANSI16}}) {
+    fmt::print("  {:<40} {:>14.1f} MB/s\n",
+               fmt::format("rewrite escapes for {} colors", name),
+               throughput(colored, [&](auto &text) {
+                 std::string out;
+                 Ansi::downgrade(text, mode, out);
+                 return out;
+               }));
+  }
+  for (auto [name, mode] : {std::pair{"truecolor", ColorMode::TRUECOLOR},
+                            std::pair{"256 colors", ColorMode::ANSI256},
+                            std::pair{"16 colors", ColorMode::ANSI16},
+                            std::pair{"no colors", ColorMode::NONE}}) {
+    fmt::print("  {:<40} {:>14} bytes\n", fmt::format("line, {}", name),
+               utils::parse(line, mode).size());
+  }
+}
+
+void screen() {
+  utils::h2("Status bar frames");
+  std::vector<std::string> bars;
+  for (int i = 0; i <= 100; i++) {
+    bars.push_back(utils::parse(fmt::format(
+        "<b>Downloading</b> <color=#ffd700>{:>3}%</color> [<green>{:=<{}}</green>"
+        "{:<{}}] <i><color=#505050>{} of 100 files</color></i>",
+        i, "", i / 2, "", 50 - i / 2, i)));
+  }
+  std::size_t full = 0, diffed = 0;
+  Screen screen;
+  for (auto &bar : bars) {
+    full += fmt::format("\x1b[1A\x1b[2K{}\n", bar).size();
+    std::string out;
+    screen.draw({bar}, out);
+    diffed += out.size();
+  }
+  fmt::print("  {:<40} {:>14.0f} bytes\n", "full redraw per frame",
+             double(full) / bars.size());
+  fmt::print("  {:<40} {:>14.0f} bytes\n", "changed cells per frame",
+             double(diffed) / bars.size());
+  int i = 0;
+  report("diffed frames", bench(200000, [&] {
+           std::string out;
+           screen.draw({bars[i++ % bars.size()]}, out);
+           return out;
+         }), "frames/s");
+}
+
+void refresh() {
+  utils::h2("Status bar from a hot loop");
+  FileSink devnull("/dev/null", ColorMode::TRUECOLOR);
+  std::atomic<int> done{0};
+  auto p = PrinterWithStatusBar();
+  p.setSink(devnull);
+  p.statusBarText = [&] {
+    return fmt::format("Processed <yellow>{}</yellow> items",
+                       done.load(std::memory_order_relaxed));
+  };
+  report("update() redraws", bench(200000, [&] {
+           done.fetch_add(1, std::memory_order_relaxed);
+           p.update();
+           return std::string_view("x");
+         }), "updates/s");
+  p.refresh(30);
+  report("update() marks for a 30 fps thread", bench(20000000, [&] {
+           done.fetch_add(1, std::memory_order_relaxed);
+           p.update();
+           return std::string_view("x");
+         }), "updates/s");
+  p.refresh(0);
+}
+
+void progressBars() {
+  utils::h2("Progress bars from many threads");
+  MemorySink terminal;
+  PrinterWithProgressBars p;
+  p.setSink(terminal);
+  p.refresh(30);
+  std::vector<PrinterWithProgressBars::Bar *> bars;
+  for (int i = 0; i < 300; i++)
+    bars.push_back(&p.add(fmt::format("job {}", i), 1000000));
+  auto threads = 8, updates = 2000000;
+  auto rate = shared(threads, updates, [&](int t, int i) {
+    bars[(t + i * threads) % bars.size()]->advance();
+  });
+  p.refresh(0);
+  report("advance() on 300 bars, 8 threads", rate, "updates/s");
+  fmt::print("  {:<40} {:>14.0f} bytes/s\n", "written to the terminal",
+             terminal.str().size() / (threads * updates / rate));
+}
+
+void recording() {
+  utils::h2("Deferred formatting");
+  FileSink devnull("/dev/null", ColorMode::TRUECOLOR);
+  auto path = std::string("/api/v1/items");
+  auto p = Printer();
+  p.setSink(devnull, OutputBuffer::Flush::FULL);
+  p.gutter.push(1, utils::green("┃"), Align::MIDDLE);
+  report("println, rendered", bench(500000, [&] {
+           p.println("<b>worker {}</b> request {} handled in {:.2f}ms path={}",
+                     3, 1234567, 12.5, path);
+           return path;
+         }));
+  p.flush();
+  MemorySink log;
+  RecordingPrinter r(log);
+  r.gutter.push(1, utils::green("┃"), Align::MIDDLE);
+  report("println, recorded", bench(500000, [&] {
+           r.println("<b>worker {}</b> request {} handled in {:.2f}ms path={}",
+                     3, 1234567, 12.5, path);
+           return path;
+         }));
+  r.flush();
+  LogDecoder decoder;
+  decoder.setSink(devnull, OutputBuffer::Flush::FULL);
+  report("decoded and rendered", bench(1, [&] {
+           decoder.feed(log.str());
+           return path;
+         }) * 500000);
+  decoder.flush();
+  fmt::print("  {:<40} {:>14.0f} bytes\n", "recorded per line",
+             log.str().size() / 500000.0);
+  RecordingPrinter shared8(devnull);
+  shared8.gutter.push(1, utils::green("┃"), Align::MIDDLE);
+  report("println, recorded, 8 threads", shared(8, 200000, [&](int t, int i) {
+           shared8.println("<b>worker {}</b> request {} handled in {:.2f}ms "
+                           "path={}",
+                           t, i, 12.5, path);
+         }));
+  shared8.flush();
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+int wstringLength(std::string s) {
+  return std::wstring_convert<std::codecvt_utf8<wchar_t>>()
+      .from_bytes(regexStripEsc(s))
+      .size();
+}
+#pragma GCC diagnostic pop
+
+void widths() {
+  utils::h2("Display width");
+  std::vector<std::pair<std::string, std::string>> texts = {
+      {"ascii", "worker-3 request handled in 12ms, status=200 bytes=5120"},
+      {"colored", utils::parse(line)},
+      {"cjk", "日本語のテキスト 中文 한국어"},
+  };
+  for (auto &[name, text] : texts) {
+    report(fmt::format("wstring_convert, {}", name), bench(100000, [&] {
+             return std::string_view(wstringLength(text) ? "x" : "");
+           }));
+    report(fmt::format("DisplayWidth, {}", name), bench(1000000, [&] {
+             return std::string_view(utils::realLength(text) ? "x" : "");
+           }));
+  }
+}
+
+int main() {
+  // Same rendering work whether or not stdout is a terminal.
+  Terminal::setColorMode(ColorMode::TRUECOLOR);
+  markup();
+  plain();
+  bytes();
+  formatting();
+  streaming();
+  stripping();
+  escapes();
+  widths();
+  json();
+  rules();
+  splitting();
+  output();
+  sinks();
+  async();
+  threads();
+  colors();
+  screen();
+  refresh();
+  progressBars();
+  recording();
+}
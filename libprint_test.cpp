@@ -101,7 +101,7 @@ void comments() {
   helpers::comment("comment line1", "comment line2");
 
   cmt.printBlock("this is multiline comment\nline1\n"
-                 "<red>FIXME:</red> markup breaks gray color of the line\n"
+                 "<red>NOTE:</red> markup keeps gray color of the line\n"
                  "line3");
 
   cmt.fgColor = fmt::color::dark_green;
@@ -159,7 +159,7 @@ void gutter() {
   p.indent = 1;
   p.markLine("<b><blue>*</blue></b>"_p, "symbol marked line");
   p.println("not marked");
-  p.markLine("<b><green>✓</blue></b>"_p, "checked with unicode symbol");
+  p.markLine("<b><green>✓</green></b>"_p, "checked with unicode symbol");
   p.markLine(fmt::color::cyan, "color marked line (empty gutter)");
   p.gutter.push("#");
   {
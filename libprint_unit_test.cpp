@@ -0,0 +1,960 @@
+#include "include/libprint/libprint.hpp"
+#include <random>
+
+using namespace LibPrint;
+using namespace std::literals;
+
+static int failures = 0;
+
+template <typename A, typename B>
+void checkEqual(const A &actual, const B &expected, const char *what,
+                int line) {
+  if (actual == expected)
+    return;
+  failures++;
+  if constexpr (std::is_convertible_v<const A &, std::string_view>)
+    fmt::print(stderr, "line {}: {}\n  got      {:?}\n  expected {:?}\n", line,
+               what, std::string_view(actual), std::string_view(expected));
+  else
+    fmt::print(stderr, "line {}: {}\n  got      {}\n  expected {}\n", line,
+               what, actual, expected);
+}
+
+#define CHECK_EQ(actual, expected)                                             \
+  checkEqual(actual, expected, #actual, __LINE__)
+#define CHECK(cond) checkEqual(bool(cond), true, #cond, __LINE__)
+
+void renderer() {
+  auto parse = [](std::string_view s, ColorMode mode = ColorMode::TRUECOLOR) {
+    return utils::parse(s, mode);
+  };
+  CHECK_EQ(parse("<b>bold</b>"), "\x1b[1mbold\x1b[0m"s);
+  CHECK_EQ(parse("<red>r</red>"), "\x1b[31mr\x1b[0m"s);
+  CHECK_EQ(parse("<b><red>x</red>y</b>"), "\x1b[1;31mx\x1b[39my\x1b[0m"s);
+  CHECK_EQ(parse("<i>a <b>b</b> a</i>"), "\x1b[3ma \x1b[1mb\x1b[22m a\x1b[0m"s);
+  CHECK_EQ(parse("plain text"), "plain text"s);
+  CHECK_EQ(parse("<unknown>x</unknown>"), "x"s);
+  // Escapes already in the text are kept and folded into the state.
+  CHECK_EQ(parse("\x1b[1mraw\x1b[0m <b>t</b>"),
+           "\x1b[1mraw\x1b[0m \x1b[1mt\x1b[0m"s);
+
+  auto orange = "<color=#ff8700>o</color>";
+  CHECK_EQ(parse(orange), "\x1b[38;2;255;135;0mo\x1b[0m"s);
+  CHECK_EQ(parse(orange, ColorMode::ANSI256), "\x1b[38;5;208mo\x1b[0m"s);
+  CHECK_EQ(parse(orange, ColorMode::ANSI16), "\x1b[33mo\x1b[0m"s);
+  CHECK_EQ(parse(orange, ColorMode::NONE), "o"s);
+  CHECK_EQ(parse("<bgcolor=#202020>g</bgcolor>", ColorMode::ANSI256),
+           "\x1b[48;5;234mg\x1b[0m"s);
+  // Three digits stand for six; any other count or a non-digit is no color
+  // and the element keeps the one around it.
+  CHECK_EQ(parse("<color=#f80>o</color>"), "\x1b[38;2;255;136;0mo\x1b[0m"s);
+  CHECK_EQ(parse("<color=f80>o</color>"), parse("<color=#f80>o</color>"));
+  for (auto bad : {"#1234567", "#12345", "#1234", "#12", "#", "", "#12345g",
+                   "#ff8700 "})
+    CHECK_EQ(parse(fmt::format("<red><color={}>o</color></red>", bad)),
+             "\x1b[31mo\x1b[0m"s);
+  CHECK(!MarkupRenderer::parseHex("#1234567"));
+  CHECK(MarkupRenderer::parseHex("#ABCDEF") == 0xabcdefu);
+
+  // Same text and attributes, cell by cell, as the peglib reference.
+  for (auto line : {"<b><color=#ffd700>Header</color></b> <i>x</i>",
+                    "<b><bgcolor=#eeeeee><color=#222222> w </color></bgcolor></b>",
+                    "<red>r</red> <s>s</s> <green>g</green>"}) {
+    Screen::Row scanned, reference;
+    Screen::parse(parse(line), scanned);
+    Screen::parse(utils::parsePeg(line), reference);
+    CHECK(scanned == reference);
+  }
+  // The reference resets everything when a nested tag closes; the scanner
+  // keeps the outer styles.
+  auto nested = "<i>a <b>b <u>c <red>d</red> c</u> b</b> a</i>";
+  CHECK_EQ(utils::stripEsc(parse(nested)), utils::stripEsc(utils::parsePeg(nested)));
+  CHECK_EQ(parse(nested), "\x1b[3ma \x1b[1mb \x1b[4mc \x1b[31md\x1b[39m c"
+                          "\x1b[24m b\x1b[22m a\x1b[0m"s);
+
+  CHECK_EQ(utils::format(ColorMode::TRUECOLOR, "<b>{}</b> {}", "<i>", 42),
+           "\x1b[1m<i>\x1b[0m 42"s);
+  // Without colors, escapes in the arguments go too.
+  auto colored = utils::parse("<red>red</red>", ColorMode::TRUECOLOR);
+  CHECK_EQ(utils::format(ColorMode::NONE, "<b>{}</b> {}", colored, 1), "red 1"s);
+  CHECK_EQ(utils::format(ColorMode::NONE, "{} {}", colored, 1), "red 1"s);
+}
+
+void markupStream() {
+  struct Result {
+    std::string text;
+    bool ok;
+  };
+  auto render = [](std::vector<std::string_view> chunks) {
+    Result result;
+    MarkupStream stream(
+        [&](std::string_view out) { result.text.append(out); });
+    for (auto chunk : chunks)
+      stream.feed(chunk);
+    result.ok = stream.finish();
+    return result;
+  };
+  auto valid = "<b>bold <color=#ff8700>or\x1b[4mange</color></b> <i>é</i>"sv;
+  CHECK_EQ(render({valid}).text, utils::parse(valid, ColorMode::TRUECOLOR));
+  // Cutting the document anywhere, once or twice, renders the same bytes,
+  // tags and escapes split across feeds included.
+  for (auto doc : {valid, "a < b <b>x</i> <red>\x1b[1;3"sv}) {
+    auto whole = render({doc});
+    CHECK_EQ(whole.ok, doc == valid);
+    for (std::size_t i = 0; i <= doc.size(); i++) {
+      for (auto j = i; j <= doc.size(); j++) {
+        auto cut = render({doc.substr(0, i), doc.substr(i, j - i),
+                           doc.substr(j)});
+        if (cut.text != whole.text || cut.ok != whole.ok) {
+          CHECK_EQ(cut.text, whole.text);
+          fmt::print(stderr, "  cut at {} and {}\n", i, j);
+          return;
+        }
+      }
+    }
+  }
+}
+
+void cache() {
+  MarkupCache cache(32);
+  auto compiles = 0;
+  auto render = [&](std::string_view text) {
+    std::string out;
+    cache.render(text, out, [&](auto text, auto &out) {
+      compiles++;
+      return utils::renderMarkup(text, out);
+    });
+    return out;
+  };
+  for (auto i = 0; i < 3; i++)
+    CHECK_EQ(render("<b>x</b>"), "\x1b[1mx\x1b[0m"s);
+  // Admitted on the second miss, a hit after that.
+  CHECK_EQ(compiles, 2);
+  auto stats = cache.stats();
+  CHECK_EQ(stats.hits, 1u);
+  CHECK_EQ(stats.misses, 2u);
+  CHECK_EQ(stats.size, 1u);
+  CHECK_EQ(stats.capacity, 32u);
+  for (auto i = 0; i < 200; i++) {
+    render(fmt::format("<i>{}</i>", i));
+    render(fmt::format("<i>{}</i>", i));
+  }
+  CHECK(cache.stats().size <= 32u);
+  cache.clear();
+  CHECK_EQ(cache.stats().size, 0u);
+
+  cache.setCapacity(1);
+  CHECK_EQ(cache.stats().capacity, 1u);
+  for (auto i = 0; i < 50; i++) {
+    render(fmt::format("<u>{}</u>", i));
+    render(fmt::format("<u>{}</u>", i));
+  }
+  CHECK(cache.stats().size <= 1u);
+  cache.setCapacity(40);
+  CHECK_EQ(cache.stats().capacity, 40u);
+}
+
+void literal() {
+  constexpr auto *rendered = "<b><red>red</red></b>"_p;
+  CHECK_EQ(std::string(rendered), "\x1b[1;31mred\x1b[0m"s);
+  CHECK_EQ(std::string("<i>a <b>b</b> a</i>"_p),
+           utils::parse("<i>a <b>b</b> a</i>", ColorMode::TRUECOLOR));
+  CHECK_EQ(std::string("no tags"_p), "no tags"s);
+  CHECK_EQ(std::string("<color=#f80>o</color>"_p),
+           utils::parse("<color=#ff8800>o</color>", ColorMode::TRUECOLOR));
+}
+
+void json() {
+  auto style = [](fmt::text_style s) {
+    Attributes attrs;
+    attrs |= s;
+    return attrs;
+  };
+  auto key = style(fmt::emphasis::bold);
+  auto string = style(fmt::fg(fmt::terminal_color::green));
+  auto number = style(fmt::fg(fmt::terminal_color::blue));
+  auto bracket =
+      style(fmt::emphasis::bold | fmt::fg(fmt::terminal_color::yellow));
+  auto doc = "{\"a:b\": [1, -2.5e3], \"s\": \"x,\\\"y\"}\n[{\"k\": 0}]"sv;
+  auto out = JsonHighlighter::highlight(doc);
+  CHECK_EQ(utils::stripEsc(out), doc);
+  // Each cell of the first line with the style it was drawn in.
+  Screen::Row row;
+  Screen::parse(out.substr(0, out.find('\n')), row);
+  auto at = [&](std::string_view text) {
+    auto line = doc.substr(0, doc.find('\n'));
+    return row[line.find(text)].attrs;
+  };
+  CHECK(at("{") == bracket);
+  // A colon inside a key is part of the key, numbers in arrays are numbers.
+  CHECK(at("\"a:b") == key);
+  CHECK(at(":b") == key);
+  CHECK(at("1") == number);
+  CHECK(at("-2.5e3") == number);
+  CHECK(at("e3") == number);
+  CHECK(at("x,") == string);
+  CHECK(at(",\\") == string);
+  CHECK(at("y") == string);
+  CHECK(at("}") == bracket);
+  CHECK_EQ(JsonHighlighter::highlight(doc, ColorMode::NONE), doc);
+
+  // Fed in pieces, the tokenizer writes the same bytes as in one pass.
+  for (std::size_t i = 0; i <= doc.size(); i++) {
+    for (auto j = i; j <= doc.size(); j++) {
+      std::string cut;
+      JsonHighlighter highlighter;
+      highlighter.feed(doc.substr(0, i), cut);
+      highlighter.feed(doc.substr(i, j - i), cut);
+      highlighter.feed(doc.substr(j), cut);
+      highlighter.finish(cut);
+      if (cut != out) {
+        CHECK_EQ(cut, out);
+        fmt::print(stderr, "  cut at {} and {}\n", i, j);
+        return;
+      }
+    }
+  }
+}
+
+void jsonStream() {
+  // Big enough that the istream and fd paths read it in several chunks.
+  std::string doc = "[\n";
+  for (auto i = 0; i < 4000; i++)
+    doc += fmt::format("  {{\"id\": {}, \"name\": \"item {}\"}},\n", i, i);
+  doc += "  {}\n]";
+  CHECK(doc.size() > 2 * JsonStream::CHUNK_SIZE);
+  auto whole = JsonHighlighter::highlight(doc);
+  std::string out;
+  auto append = [&](std::string_view text) { out.append(text); };
+  {
+    JsonStream stream(append);
+    for (auto c : doc)
+      stream.feed(std::string_view(&c, 1));
+    stream.finish();
+  }
+  CHECK(out == whole);
+  out.clear();
+  {
+    JsonStream stream(append);
+    std::istringstream in(doc);
+    stream.feed(in);
+    stream.finish();
+  }
+  CHECK(out == whole);
+
+  // HighlightPrinter writes each line with the gutters once it ends, and
+  // the last one on end().
+  MemorySink sink(ColorMode::NONE), expected(ColorMode::NONE);
+  HighlightPrinter p;
+  p.setSink(sink);
+  p.gutter.push(1, "┃", Align::MIDDLE);
+  auto s = p.stream();
+  s.feed("{\"a\": [1,\n  2]");
+  CHECK_EQ(sink.str(), "┃{\"a\": [1,\n"sv);
+  s.feed(",\n\"b\": true}");
+  CHECK_EQ(sink.str(), "┃{\"a\": [1,\n┃  2],\n"sv);
+  p.end(s);
+  CHECK_EQ(sink.str(), "┃{\"a\": [1,\n┃  2],\n┃\"b\": true}\n"sv);
+
+  // A file descriptor is read to its end.
+  sink.clear();
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  std::thread writer([&] {
+    auto rest = std::string_view(doc);
+    while (!rest.empty()) {
+      auto n = ::write(fds[1], rest.data(), rest.size());
+      if (n <= 0)
+        break;
+      rest.remove_prefix(n);
+    }
+    close(fds[1]);
+  });
+  CHECK(p.print(fds[0]));
+  writer.join();
+  close(fds[0]);
+  p.flush();
+  Printer plain;
+  plain.setSink(expected);
+  plain.gutter.push(1, "┃", Align::MIDDLE);
+  std::istringstream lines(doc);
+  for (std::string line; std::getline(lines, line);)
+    plain.println("{}", line);
+  plain.flush();
+  CHECK(sink.str() == expected.str());
+}
+
+void escapes() {
+  auto scan = [](std::string_view text, Ansi::Escape &esc) {
+    auto p = text.data();
+    auto result = Ansi::scanEscape(p, text.data() + text.size(), esc);
+    return std::pair{result, std::size_t(p - text.data())};
+  };
+  Ansi::Escape esc;
+  CHECK((scan("\x1b[1;31mx", esc) == std::pair{Ansi::Scan::OK, std::size_t(7)}));
+  CHECK_EQ(esc.params, "1;31"sv);
+  CHECK_EQ(esc.final, 'm');
+  CHECK(esc.csi && Ansi::isSgr(esc));
+  CHECK(scan("\x1b[2K", esc).first == Ansi::Scan::OK);
+  CHECK(!Ansi::isSgr(esc));
+  CHECK((scan("\x1b" "7", esc) == std::pair{Ansi::Scan::OK, std::size_t(2)}));
+  CHECK(!esc.csi);
+  CHECK(scan("\x1b[1;3", esc).first == Ansi::Scan::INCOMPLETE);
+  CHECK(scan("\x1b", esc).first == Ansi::Scan::INCOMPLETE);
+  CHECK(scan("\x1b[1\x01", esc).first == Ansi::Scan::INVALID);
+  // OSC runs up to BEL or ST.
+  CHECK((scan("\x1b]0;title\ax", esc) == std::pair{Ansi::Scan::OK, std::size_t(10)}));
+  CHECK_EQ(esc.params, "0;title"sv);
+  CHECK_EQ(esc.final, ']');
+  CHECK((scan("\x1b]8;;http://a\x1b\\x", esc) ==
+         std::pair{Ansi::Scan::OK, std::size_t(15)}));
+  CHECK_EQ(esc.params, "8;;http://a"sv);
+  CHECK(scan("\x1b]0;title", esc).first == Ansi::Scan::INCOMPLETE);
+  CHECK(scan("\x1b]0;t\x1b", esc).first == Ansi::Scan::INCOMPLETE);
+
+  CHECK_EQ(utils::stripEsc("\x1b[1mbold\x1b[0m \x1b[2Kx"), "bold x"s);
+  // Incomplete sequences are kept as text.
+  CHECK_EQ(utils::stripEsc("a\x1b[1"), "a\x1b[1"s);
+  // A string handed over is stripped in its own buffer; an lvalue is copied.
+  std::string owned = "\x1b[1mbold\x1b[0m and long enough to be on the heap";
+  auto copy = utils::stripEsc(owned);
+  auto buffer = owned.data();
+  auto stripped = utils::stripEsc(std::move(owned));
+  CHECK_EQ(stripped, copy);
+  CHECK_EQ(stripped, "bold and long enough to be on the heap"s);
+  CHECK(stripped.data() == buffer);
+  CHECK_EQ(utils::stripEsc("\x1b]8;;http://a\x1b\\link\x1b]8;;\x1b\\ \x1b]2;t\a."),
+           "link ."s);
+
+  std::string text = "\x1b[38;2;255;135;0mo\x1b[0m";
+  Ansi::downgrade(text, ColorMode::ANSI16);
+  CHECK_EQ(text, "\x1b[33mo\x1b[0m"s);
+}
+
+void widths() {
+  auto width = [](std::string_view s) { return DisplayWidth::of(s); };
+  CHECK_EQ(width("hello"), 5u);
+  CHECK_EQ(width(""), 0u);
+  CHECK_EQ(width("\x1b[1mbold\x1b[0m"), 4u);
+  CHECK_EQ(width("\x1b]8;;http://example.com\x1b\\link\x1b]8;;\x1b\\"), 4u);
+  CHECK_EQ(width("日本語"), 6u);
+  CHECK_EQ(width("é"), 1u);       // e + combining acute
+  CHECK_EQ(width("🙂"), 2u);
+  CHECK_EQ(width("👩‍💻"), 2u);     // ZWJ sequence
+  CHECK_EQ(width("👍🏽"), 2u);     // skin tone modifier
+  CHECK_EQ(width("🇩🇪🇫🇷"), 4u); // two flags
+  CHECK_EQ(width("❤️"), 2u);      // VS16
+  CHECK_EQ(utils::realLength(utils::parse("<b>日本</b>")), 4);
+  // Control characters take no columns.
+  CHECK_EQ(width("a\tb\x7f"), 2u);
+  Screen::Row row;
+  Screen::parse("a\tb\x7f日", row);
+  CHECK_EQ(row.size(), 4u);
+  CHECK_EQ(row[0].text, "a"s);
+  CHECK_EQ(row[1].text, "b"s);
+  CHECK_EQ(row[2].text, "日"s);
+
+  auto decode = [](std::string_view s) {
+    auto p = s.data();
+    return DisplayWidth::decode(p, s.data() + s.size());
+  };
+  CHECK(decode("a") == U'a');
+  CHECK(decode("\t") == U'\t');
+  CHECK(decode("é") == U'é');
+  CHECK(decode("日") == U'日');
+  CHECK(decode("\xe6\x97") == U'\xfffd');
+  CHECK(decode("\xff") == U'\xfffd');
+}
+
+// A terminal that knows what Screen writes: text, newlines, carriage
+// returns, SGR, cursor up/down/column and erase to the end of the line or
+// the screen.
+struct ModelTerminal {
+  std::vector<Screen::Row> lines{1};
+  std::size_t row = 0, col = 0;
+  Attributes attrs;
+
+  void feed(std::string_view data) {
+    auto p = data.data();
+    auto end = p + data.size();
+    while (p < end) {
+      if (*p == '\n' || *p == '\r') {
+        if (*p++ == '\n')
+          moveTo(row + 1);
+        col = 0;
+        continue;
+      }
+      if (*p == '\x1b') {
+        Ansi::Escape esc;
+        if (Ansi::scanEscape(p, end, esc) != Ansi::Scan::OK) {
+          failures++;
+          return;
+        }
+        escape(esc);
+        continue;
+      }
+      auto start = p;
+      while (p < end && *p != '\x1b' && *p != '\n' && *p != '\r')
+        p++;
+      Screen::Row cells;
+      Screen::parse(std::string_view(start, p - start), cells);
+      auto &line = lines[row];
+      for (auto &cell : cells) {
+        if (line.size() <= col)
+          line.resize(col + 1, Screen::Cell{" ", {}});
+        line[col++] = Screen::Cell{cell.text, attrs};
+      }
+    }
+  }
+
+  void moveTo(std::size_t r) {
+    row = r;
+    if (lines.size() <= row)
+      lines.resize(row + 1);
+  }
+
+  void escape(const Ansi::Escape &esc) {
+    if (Ansi::isSgr(esc)) {
+      Ansi::applySgr(esc.params, attrs, Attributes{});
+      return;
+    }
+    std::size_t n = 0;
+    for (auto c : esc.params)
+      n = n * 10 + (c - '0');
+    n = std::max<std::size_t>(n, 1);
+    auto &line = lines[row];
+    switch (esc.final) {
+    case 'A':
+      moveTo(row - std::min(n, row));
+      break;
+    case 'B':
+      moveTo(row + n);
+      break;
+    case 'G':
+      col = n - 1;
+      break;
+    case 'J':
+      lines.resize(row + 1);
+      [[fallthrough]];
+    case 'K':
+      if (line.size() > col)
+        line.resize(col);
+      break;
+    default:
+      failures++;
+    }
+  }
+};
+
+void screen() {
+  // Rows change a piece at a time, grow, shrink and change height; lines
+  // are printed above them now and then. After every frame the terminal
+  // shows exactly the rows, with the log lines above, as a full redraw
+  // would.
+  std::vector<std::string_view> pieces = {
+      "a",  "bc",         "日本",          "e\xcc\x81",
+      "  ", "<b>x</b>",   "<red>yy</red>", "<bgcolor=#202020> - </bgcolor>",
+      "-",  "<i>é日</i>", "🙂"};
+  std::mt19937 rng(22);
+  auto pick = [&](std::size_t n) { return std::size_t(rng() % n); };
+  std::vector<std::vector<std::size_t>> markup;
+  ModelTerminal term;
+  Screen screen;
+  std::size_t logged = 0, diffBytes = 0, fullBytes = 0;
+  for (auto frame = 0; frame < 600; frame++) {
+    markup.resize(1 + frame / 150 % 3);
+    for (auto &row : markup) {
+      if (row.empty() || pick(4) == 0) {
+        row.resize(pick(12));
+        for (auto &piece : row)
+          piece = pick(pieces.size());
+      } else if (pick(2) == 0) {
+        row[pick(row.size())] = pick(pieces.size());
+      }
+    }
+    std::vector<std::string> texts;
+    for (auto &row : markup) {
+      std::string text;
+      for (auto piece : row)
+        text += pieces[piece];
+      texts.push_back(utils::parse(text, ColorMode::TRUECOLOR));
+    }
+    std::vector<std::string_view> rows(texts.begin(), texts.end());
+    std::string out;
+    if (frame % 7 == 0) {
+      screen.print(fmt::format("log {}\n", logged++), rows, out);
+    } else {
+      screen.draw(rows, out);
+    }
+    term.feed(out);
+    diffBytes += out.size();
+    std::string full;
+    Screen().draw(rows, full);
+    fullBytes += full.size();
+
+    CHECK_EQ(term.col, 0u);
+    CHECK(term.attrs.empty());
+    CHECK_EQ(term.row, logged + rows.size());
+    CHECK_EQ(term.lines.size(), term.row + 1);
+    for (std::size_t r = 0; r < rows.size(); r++) {
+      Screen::Row expected;
+      Screen::parse(rows[r], expected);
+      if (term.lines[logged + r] != expected) {
+        fmt::print(stderr, "line {}: frame {} row {} differs\n", __LINE__,
+                   frame, r);
+        failures++;
+        return;
+      }
+    }
+    // The same frame again writes nothing.
+    out.clear();
+    screen.draw(rows, out);
+    CHECK_EQ(out, ""s);
+  }
+  for (std::size_t i = 0; i < logged; i++) {
+    Screen::Row expected;
+    Screen::parse(fmt::format("log {}", i), expected);
+    CHECK(term.lines[i] == expected);
+  }
+  CHECK(diffBytes < fullBytes);
+}
+
+void progressBars() {
+  MemorySink sink;
+  PrinterWithProgressBars p;
+  p.setSink(sink);
+  p.labelWidth = 6;
+  p.barLength = 4;
+  // Labels are padded by the width of their rendered markup.
+  auto &bar = p.add("<b>ab</b>", 4);
+  bar.advance(2);
+  p.finish(bar);
+  p.flush();
+  CHECK_EQ(utils::stripEsc(sink.str()), "ab     ━━━━  50% 2/4\n"s);
+}
+
+// Records when each write started and ended; the next write can be made to
+// take a while, like a terminal that stopped reading.
+class FrameSink : public Sink {
+public:
+  using Clock = std::chrono::steady_clock;
+  struct Frame {
+    Clock::time_point start, end;
+    std::string text;
+  };
+
+  std::atomic<int> stallMs{0};
+
+  std::vector<Frame> frames() {
+    std::lock_guard lock(mutex);
+    return seen;
+  }
+
+protected:
+  void write(std::string_view t) override {
+    auto start = Clock::now();
+    if (auto ms = stallMs.exchange(0))
+      std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    std::lock_guard lock(mutex);
+    seen.push_back(Frame{start, Clock::now(), std::string(t)});
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<Frame> seen;
+};
+
+void statusBar() {
+  using namespace std::chrono;
+  std::atomic<int> count{0};
+  auto bar = [&] { return fmt::format("n={}", count.load()); };
+  {
+    // While the refresh thread runs, update() only marks the bar; refresh(0)
+    // draws what is pending.
+    FrameSink sink;
+    PrinterWithStatusBar p;
+    p.setSink(sink);
+    p.statusBarText = bar;
+    p.refresh(1);
+    count = 7;
+    p.update();
+    CHECK_EQ(sink.frames().size(), 0u);
+    p.refresh(0);
+    auto frames = sink.frames();
+    CHECK_EQ(frames.size(), 1u);
+    CHECK(!frames.empty() &&
+          utils::stripEsc(frames.back().text).find("n=7") != std::string::npos);
+    // Nothing pending, nothing drawn.
+    p.refresh(1);
+    p.refresh(0);
+    CHECK_EQ(sink.frames().size(), 1u);
+  }
+  {
+    // Updates in a loop are drawn at most at the frame rate, and frames
+    // missed while the sink stalled are not made up in a burst.
+    FrameSink sink;
+    PrinterWithStatusBar p;
+    p.setSink(sink);
+    p.statusBarText = bar;
+    p.refresh(50);
+    auto start = steady_clock::now();
+    auto stalled = false;
+    while (steady_clock::now() - start < 600ms) {
+      count++;
+      p.update();
+      if (!stalled && steady_clock::now() - start > 100ms) {
+        sink.stallMs = 200;
+        stalled = true;
+      }
+      std::this_thread::sleep_for(100us);
+    }
+    p.refresh(0);
+    auto frames = sink.frames();
+    // 30 frames at 50fps, less the 10 missed in the stall.
+    CHECK(frames.size() >= 2u);
+    CHECK(frames.size() <= 25u);
+    auto stall = std::find_if(frames.begin(), frames.end(), [](auto &f) {
+      return f.end - f.start >= 150ms;
+    });
+    CHECK(stall != frames.end());
+    if (stall == frames.end())
+      return;
+    auto burst = std::count_if(stall + 1, frames.end(), [&](auto &f) {
+      return f.start < stall->end + 10ms;
+    });
+    CHECK(burst <= 1);
+  }
+}
+
+void comments() {
+  MemorySink sink(ColorMode::NONE);
+  CommentPrinter p;
+  p.setSink(sink);
+  p.printBlock("first <b>{}</b>\nmiddle {}\nlast", 1, "{x}");
+  p.printBlock("single");
+  p.flush();
+  CHECK_EQ(sink.str(), "/*  first 1\n *  middle {x}\n */ last\n/*  single\n"sv);
+}
+
+void flushing() {
+  using Flush = OutputBuffer::Flush;
+  std::string block(OutputBuffer::CAPACITY, 'x');
+  {
+    MemorySink sink;
+    OutputBuffer out(sink, Flush::LINE);
+    out.write("a");
+    CHECK_EQ(sink.str(), ""sv);
+    out.writeLines("b\n");
+    CHECK_EQ(sink.str(), "ab\n"sv);
+  }
+  {
+    MemorySink sink;
+    OutputBuffer out(sink, Flush::FULL);
+    out.writeLines("a\n");
+    CHECK_EQ(sink.str(), ""sv);
+    out.write(block);
+    CHECK_EQ(sink.str().size(), block.size() + 2);
+  }
+  {
+    MemorySink sink;
+    OutputBuffer out(sink, Flush::EXPLICIT);
+    out.writeLines("a\n");
+    out.write(block);
+    CHECK_EQ(sink.str(), ""sv);
+    CHECK(out.flush());
+    CHECK_EQ(sink.str().size(), block.size() + 2);
+  }
+  {
+    // Flushed by the timer although no other line follows.
+    MemorySink sink;
+    OutputBuffer out(sink, Flush::INTERVAL);
+    out.interval = std::chrono::milliseconds(20);
+    out.writeLines("a\n");
+    out.write("b");
+    auto start = std::chrono::steady_clock::now();
+    while (out.size() > 0 &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    CHECK_EQ(out.size(), 0u);
+    CHECK_EQ(sink.str(), "a\nb"sv);
+  }
+  {
+    // Buffered, then flushed on destruction.
+    MemorySink sink;
+    {
+      OutputBuffer out(sink, Flush::INTERVAL);
+      out.interval = std::chrono::hours(1);
+      out.writeLines("a\n");
+      out.writeLines("b\n");
+    }
+    CHECK_EQ(sink.str(), "a\nb\n"sv);
+  }
+}
+
+// Holds the writer thread in write() until opened, so the queue fills up.
+class GateSink : public Sink {
+public:
+  void open() {
+    {
+      std::lock_guard lock(mutex);
+      isOpen = true;
+    }
+    opened.notify_all();
+  }
+
+  std::string text() {
+    std::lock_guard lock(mutex);
+    return seen;
+  }
+
+protected:
+  void write(std::string_view t) override {
+    std::unique_lock lock(mutex);
+    opened.wait(lock, [&] { return isOpen; });
+    seen += t;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable opened;
+  bool isOpen = false;
+  std::string seen;
+};
+
+void async() {
+  // Lines of one producer keep their order, with several producers sharing
+  // a printer.
+  MemorySink sink;
+  {
+    AsyncSink queue(sink, 64);
+    Printer p;
+    p.gutter = Gutter();
+    p.setSink(queue);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < 2000; i++)
+          p.println("{} {}", t, i);
+      });
+    for (auto &thread : threads)
+      thread.join();
+    queue.drain();
+    std::array<int, 4> next{};
+    auto ordered = true;
+    auto lines = 0;
+    for (auto line : utils::lines(sink.str())) {
+      if (line.empty())
+        continue;
+      auto t = line[0] - '0';
+      ordered = ordered && std::stoi(std::string(line.substr(2))) == next[t]++;
+      lines++;
+    }
+    CHECK(ordered);
+    CHECK_EQ(lines, 8000);
+  }
+
+  auto numbers = [](int n) {
+    std::string text;
+    for (int i = 0; i < n; i++)
+      text += fmt::format("{}\n", i);
+    return text;
+  };
+  {
+    GateSink gate;
+    AsyncSink queue(gate, 2, AsyncSink::Overflow::DROP);
+    for (int i = 0; i < 20; i++)
+      queue.send(fmt::format("{}\n", i));
+    CHECK(queue.dropped() > 0);
+    gate.open();
+    queue.drain();
+    auto lines = utils::split(gate.text(), '\n');
+    CHECK_EQ(lines.size() + queue.dropped(), 20u);
+    CHECK(std::is_sorted(lines.begin(), lines.end(), [](auto &a, auto &b) {
+      return std::stoi(a) < std::stoi(b);
+    }));
+  }
+  {
+    GateSink gate;
+    AsyncSink queue(gate, 2, AsyncSink::Overflow::GROW);
+    for (int i = 0; i < 20; i++)
+      queue.send(fmt::format("{}\n", i));
+    gate.open();
+    queue.drain();
+    CHECK_EQ(gate.text(), numbers(20));
+    CHECK_EQ(queue.dropped(), 0u);
+  }
+  {
+    // Whatever is queued reaches the target before the sink goes away.
+    GateSink gate;
+    {
+      AsyncSink queue(gate, 4, AsyncSink::Overflow::BLOCK);
+      std::thread opener([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        gate.open();
+      });
+      for (int i = 0; i < 50; i++)
+        queue.send(fmt::format("{}\n", i));
+      opener.join();
+    }
+    CHECK_EQ(gate.text(), numbers(50));
+  }
+}
+
+void sinks() {
+  // Printers with a sink render in full color although main() turned colors
+  // off for stdout; each sink converts to its own mode.
+  MemorySink color, ansi(ColorMode::ANSI16), plain(ColorMode::NONE);
+  FanoutSink both{&ansi, &plain};
+  Printer p, q;
+  p.setSink(color);
+  q.setSink(both);
+  for (auto printer : {&p, &q}) {
+    printer->gutter = Gutter();
+    printer->println("<color=#ff8700>o</color> {}", 1);
+    printer->flush();
+  }
+  CHECK_EQ(color.str(), "\x1b[38;2;255;135;0mo\x1b[0m 1\n"sv);
+  CHECK_EQ(ansi.str(), "\x1b[33mo\x1b[0m 1\n"sv);
+  CHECK_EQ(plain.str(), "o 1\n"sv);
+
+  NumberedPrinter numbered;
+  MemorySink lines;
+  numbered.setSink(lines);
+  numbered.println("x");
+  numbered.flush();
+  CHECK(lines.str().find("\x1b[38;2;") != std::string_view::npos);
+}
+
+void recording() {
+  MemorySink direct, recorded, decoded;
+  auto lines = [](auto &p) {
+    p.gutter.push(1, "┃", Align::MIDDLE);
+    p.println("<b>{}</b> handled {} in {:.2f}ms ok={} c={} f={}",
+              std::string("worker-3"), 42u, 12.345, true, 'x', 0.1f);
+    p.println("negative {} {:x} {:>6}|", -5, 255, "right"sv);
+    p.gutter.push(2, "▌", Align::LEFT);
+    p.println("nested {}", "cstr");
+    p.gutter.pop();
+    p.print("no newline {}", 7);
+    p.println();
+    p.println("braces {{}} and tags in args {}", "<b>{}</b>");
+    p.markLine("*", "marked {}", 1);
+    p.markLine(fmt::color::red, "red {}", 2);
+    p.printGutters();
+    p.println("after the gutters");
+  };
+  {
+    auto p = Printer();
+    p.setSink(direct);
+    lines(p);
+    p.flush();
+  }
+  {
+    RecordingPrinter p(recorded);
+    lines(p);
+    p.flush();
+  }
+  LogDecoder decoder;
+  decoder.setSink(decoded);
+  // Records split at every possible point still decode.
+  auto bytes = recorded.str();
+  auto ok = true;
+  for (std::size_t i = 0; i < bytes.size(); i++)
+    ok = decoder.feed(bytes.substr(i, 1)) && ok;
+  decoder.flush();
+  CHECK(ok);
+  CHECK(decoder.done());
+  CHECK_EQ(decoded.str(), direct.str());
+
+  LogDecoder garbage;
+  CHECK(!garbage.feed("not a recording"));
+
+  // A record whose arguments don't fit its format string stops decoding
+  // instead of throwing, and is not decoded again.
+  MemorySink bad, out;
+  {
+    RecordingPrinter p(bad);
+    p.println("fine {}", 1);
+    p.println("{:.2f}", "not a number");
+    p.println("never decoded");
+    p.flush();
+  }
+  LogDecoder strict;
+  strict.setSink(out);
+  CHECK(!strict.feed(bad.str()));
+  CHECK(!strict.feed(""));
+  strict.flush();
+  CHECK_EQ(out.str(), "fine 1\n"sv);
+
+  // Records reach sinks that convert colors unchanged, and the sink keeps
+  // its mode; through an AsyncSink as well.
+  MemorySink plain(ColorMode::NONE), queued(ColorMode::NONE);
+  {
+    RecordingPrinter p(plain);
+    lines(p);
+    p.flush();
+  }
+  CHECK(plain.colorMode == ColorMode::NONE);
+  CHECK_EQ(plain.str(), recorded.str());
+  {
+    AsyncSink async(queued);
+    RecordingPrinter p(async);
+    lines(p);
+    p.flush();
+    async.flush();
+  }
+  CHECK_EQ(queued.str(), recorded.str());
+
+  // A record naming a format or gutter id that was never defined stops
+  // decoding.
+  auto u32 = [](std::string &data, std::uint32_t value) {
+    data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  std::string header(1, RecordingPrinter::HEADER);
+  header += RecordingPrinter::MAGIC;
+  auto noFormat = header, noGutters = header, noPrefix = header;
+  noFormat += RecordingPrinter::TEXT;
+  u32(noFormat, 7);
+  u32(noFormat, 0);
+  noGutters += RecordingPrinter::FORMAT;
+  u32(noGutters, 7);
+  u32(noGutters, 0);
+  noGutters += RecordingPrinter::LINE;
+  u32(noGutters, 7);
+  u32(noGutters, 9);
+  u32(noGutters, 0);
+  noPrefix += RecordingPrinter::PREFIX;
+  u32(noPrefix, 3);
+  MemorySink unknown;
+  for (auto data : {noFormat, noGutters, noPrefix}) {
+    LogDecoder decoder;
+    decoder.setSink(unknown);
+    CHECK(!decoder.feed(data));
+    decoder.flush();
+  }
+  CHECK_EQ(unknown.str(), ""sv);
+}
+
+int main() {
+  // Tests pass explicit modes; printers with a sink must not depend on stdout.
+  Terminal::setColorMode(ColorMode::NONE);
+  renderer();
+  markupStream();
+  cache();
+  literal();
+  json();
+  jsonStream();
+  escapes();
+  widths();
+  screen();
+  progressBars();
+  statusBar();
+  comments();
+  flushing();
+  async();
+  sinks();
+  recording();
+  if (failures)
+    fmt::print(stderr, "{} checks failed\n", failures);
+  return failures ? 1 : 0;
+}
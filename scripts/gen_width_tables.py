@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+# Generates include/libprint/width_tables.hpp from the unicodedata module of
+# the running Python. Run from the repository root.
+import sys
+import unicodedata
+
+
+def ranges(predicate):
+    out = []
+    for c in range(0x110000):
+        if not predicate(c):
+            continue
+        if out and out[-1][1] == c - 1:
+            out[-1][1] = c
+        else:
+            out.append([c, c])
+    return out
+
+
+def wide(c):
+    # Unassigned code points default to wide only in the CJK ideograph
+    # blocks.
+    if unicodedata.category(chr(c)) == "Cn":
+        return (0x3400 <= c <= 0x4DBF or 0x4E00 <= c <= 0x9FFF or
+                0xF900 <= c <= 0xFAFF or 0x20000 <= c <= 0x3FFFD)
+    return unicodedata.east_asian_width(chr(c)) in ("W", "F")
+
+
+def zero(c):
+    if c == 0x00AD:
+        return False
+    if 0x1160 <= c <= 0x11FF or c == 0x200B:
+        return True
+    return unicodedata.category(chr(c)) in ("Mn", "Me", "Cf")
+
+
+def emit(rs):
+    out = []
+    row = "  "
+    for first, last in rs:
+        item = f"{{0x{first:04x}, 0x{last:04x}}}, "
+        if len(row) + len(item) > 80:
+            out.append(row.rstrip())
+            row = "  "
+        row += item
+    out.append(row.rstrip())
+    return "\n".join(out)
+
+
+print(f"""// Generated by scripts/gen_width_tables.py from Unicode \
+{unicodedata.unidata_version}. Do not edit.
+#pragma once
+#include <cstdint>
+
+namespace LibPrint {{
+
+struct WidthRange {{
+  uint32_t first;
+  uint32_t last;
+}};
+
+// East Asian Wide and Fullwidth code points, which includes emoji with
+// default emoji presentation.
+inline constexpr WidthRange WIDE_RANGES[] = {{
+{emit(ranges(wide))}
+}};
+
+// Combining marks, format characters and Hangul medial vowels and final
+// consonants.
+inline constexpr WidthRange ZERO_WIDTH_RANGES[] = {{
+{emit(ranges(zero))}
+}};
+
+}} // namespace LibPrint""", file=open(sys.argv[1], "w") if len(sys.argv) > 1 else sys.stdout)